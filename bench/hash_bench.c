@@ -0,0 +1,349 @@
+// Measure hash_string(): the time per hash, and how long the probes of the
+// tables keyed by the hashes get. Build it once with WITH_FAST_STRING_HASH on
+// and once with it off to compare the two hashes:
+//
+//   hash_bench bench/corpora/identifiers.txt bench/corpora/lines.txt
+//
+// Each line of a corpus file is a key. The keys made up here are those of a
+// program filling a map, item0 to item199999, and random words of a to z.
+// Each corpus file is also hashed whole, for the throughput on long strings.
+#include "common.h"
+#include "object.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define GENERATED_KEYS 200000
+#define MIN_RUN_NS 200000000u
+
+// As in struct intern_set: linear probing, grown at 3/4 full.
+#define LINEAR_MAX_LOAD 0.75
+
+// As in struct table: groups of 16 slots, grown at 7/8 full.
+#define GROUP_SIZE 16
+#define GROUP_MAX_LOAD 0.875
+#define GROUP_EMPTY 0x80
+
+struct key {
+    const char *chars;
+    size_t length;
+};
+
+struct key_set {
+    const char *name;
+    struct key *keys;
+    size_t count;
+    size_t capacity;
+};
+
+static void *checked_malloc(size_t size)
+{
+    void *memory = malloc(size);
+    if (!memory) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return memory;
+}
+
+static u64 now_ns(void)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (u64)now.tv_sec * 1000000000u + (u64)now.tv_nsec;
+}
+
+static char *read_file(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    fseek(file, 0L, SEEK_END);
+    const i64 file_size = ftell(file);
+    rewind(file);
+    if (file_size <= 0) {
+        fprintf(stderr, "File \"%s\" is empty.\n", path);
+        exit(74);
+    }
+
+    char *buffer = checked_malloc((size_t)file_size);
+    if (fread(buffer, 1, (size_t)file_size, file) < (size_t)file_size) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    fclose(file);
+    *length = (size_t)file_size;
+    return buffer;
+}
+
+static void add_key(struct key_set *set, const char *chars, size_t length)
+{
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity < 8 ? 8 : set->capacity * 2;
+        set->keys = realloc(set->keys, sizeof(struct key) * set->capacity);
+        if (!set->keys) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    set->keys[set->count].chars = chars;
+    set->keys[set->count].length = length;
+    set->count++;
+}
+
+static void free_keys(struct key_set *set)
+{
+    free(set->keys);
+}
+
+// The keys point into the text, which has to outlive them.
+static struct key_set split_lines(const char *name, const char *text,
+                                  size_t length)
+{
+    struct key_set set = {name, NULL, 0, 0};
+    const char *end = text + length;
+    while (text < end) {
+        const char *line_end = memchr(text, '\n', (size_t)(end - text));
+        if (!line_end)
+            line_end = end;
+        if (line_end > text)
+            add_key(&set, text, (size_t)(line_end - text));
+        text = line_end + 1;
+    }
+    return set;
+}
+
+static char *make_items(struct key_set *set)
+{
+    char *text = checked_malloc(GENERATED_KEYS * 12);
+    char *next = text;
+    for (i32 i = 0; i < GENERATED_KEYS; i++) {
+        const i32 length = sprintf(next, "item%d", i);
+        add_key(set, next, (size_t)length);
+        next += length;
+    }
+    return text;
+}
+
+static u64 random_next(u64 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Words of 6 to 12 letters, which are few enough to repeat only rarely.
+static char *make_words(struct key_set *set)
+{
+    char *text = checked_malloc(GENERATED_KEYS * 12);
+    char *next = text;
+    u64 state = 0x2545f4914f6cdd1du;
+    for (i32 i = 0; i < GENERATED_KEYS; i++) {
+        const size_t length = 6 + random_next(&state) % 7;
+        for (size_t j = 0; j < length; j++) {
+            next[j] = (char)('a' + random_next(&state) % 26);
+        }
+        add_key(set, next, length);
+        next += length;
+    }
+    return text;
+}
+
+// Hash the keys over and over for at least MIN_RUN_NS.
+static f64 time_hashes(const struct key_set *set)
+{
+    u32 sink = 0;
+    size_t rounds = 0;
+    const u64 start = now_ns();
+    u64 elapsed;
+    do {
+        for (size_t i = 0; i < set->count; i++) {
+            sink += hash_string(set->keys[i].chars, set->keys[i].length);
+        }
+        rounds++;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_RUN_NS);
+
+    // Keep the compiler from dropping the hashes.
+    if (sink == 1)
+        fputc('\0', stderr);
+    return (f64)elapsed / (f64)(rounds * set->count);
+}
+
+// The largest power of two capacity that the keys can fill to the load.
+static size_t capacity_at_load(size_t count, f64 load, size_t minimum)
+{
+    size_t capacity = minimum;
+    while ((f64)(capacity * 2) * load <= (f64)count) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// Fill a linearly probed table to its maximum load.
+// Returns the mean number of slots a lookup of a key in it reads.
+static f64 linear_probes(const u32 *hashes, size_t count)
+{
+    const size_t capacity = capacity_at_load(count, LINEAR_MAX_LOAD, 8);
+    const size_t mask = capacity - 1;
+    const size_t used = (size_t)((f64)capacity * LINEAR_MAX_LOAD);
+    bool *full = calloc(capacity, sizeof(bool));
+    if (!full) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    size_t probes = 0;
+    for (size_t i = 0; i < used && i < count; i++) {
+        size_t index = hashes[i] & mask;
+        probes++;
+        while (full[index]) {
+            index = (index + 1) & mask;
+            probes++;
+        }
+        full[index] = true;
+    }
+    free(full);
+    return (f64)probes / (f64)(used < count ? used : count);
+}
+
+struct group_probes {
+    f64 groups;
+    f64 false_matches;
+};
+
+// Fill a table probed a group at a time to its maximum load.
+// Returns the mean number of groups a lookup of a key in it reads, and how
+// many slots of those groups have the seven bits of its hash but another key.
+static struct group_probes group_probes(const u32 *hashes, size_t count)
+{
+    const size_t capacity =
+        capacity_at_load(count, GROUP_MAX_LOAD, GROUP_SIZE);
+    const size_t mask = capacity - 1;
+    size_t used = (size_t)((f64)capacity * GROUP_MAX_LOAD);
+    if (used > count)
+        used = count;
+    u8 *control = checked_malloc(capacity);
+    size_t *slots = checked_malloc(sizeof(size_t) * used);
+    memset(control, GROUP_EMPTY, capacity);
+
+    for (size_t i = 0; i < used; i++) {
+        size_t group = ((size_t)(hashes[i] >> 7) * GROUP_SIZE) & mask;
+        size_t step = GROUP_SIZE;
+        size_t slot = group;
+        while (control[slot] != GROUP_EMPTY) {
+            if (++slot == group + GROUP_SIZE) {
+                group = (group + step) & mask;
+                step += GROUP_SIZE;
+                slot = group;
+            }
+        }
+        control[slot] = (u8)(hashes[i] & 0x7f);
+        slots[i] = slot;
+    }
+
+    size_t groups = 0;
+    size_t false_matches = 0;
+    for (size_t i = 0; i < used; i++) {
+        const u8 tag = (u8)(hashes[i] & 0x7f);
+        size_t group = ((size_t)(hashes[i] >> 7) * GROUP_SIZE) & mask;
+        for (size_t step = GROUP_SIZE;; step += GROUP_SIZE) {
+            groups++;
+            bool found = false;
+            for (size_t slot = group; slot < group + GROUP_SIZE; slot++) {
+                if (slot == slots[i])
+                    found = true;
+                else if (control[slot] == tag)
+                    false_matches++;
+            }
+            if (found)
+                break;
+            group = (group + step) & mask;
+        }
+    }
+    free(control);
+    free(slots);
+    return (struct group_probes){(f64)groups / (f64)used,
+                                 (f64)false_matches / (f64)used};
+}
+
+static void report(const struct key_set *set)
+{
+    u32 *hashes = checked_malloc(sizeof(u32) * set->count);
+    size_t bytes = 0;
+    for (size_t i = 0; i < set->count; i++) {
+        hashes[i] = hash_string(set->keys[i].chars, set->keys[i].length);
+        bytes += set->keys[i].length;
+    }
+
+    const f64 ns = time_hashes(set);
+    const struct group_probes group = group_probes(hashes, set->count);
+    printf("%-18s %8zu %7.1f %8.1f %9.2f %8.2f %9.3f\n", set->name,
+           set->count, ns, (f64)bytes / (f64)set->count,
+           linear_probes(hashes, set->count), group.groups,
+           group.false_matches);
+    free(hashes);
+}
+
+static void report_throughput(const char *name, const char *text,
+                              size_t length)
+{
+    struct key_set whole = {name, NULL, 0, 0};
+    add_key(&whole, text, length);
+    const f64 ns = time_hashes(&whole);
+    printf("%s hashed whole: %zu bytes, %.2f GB/s\n", name, length,
+           (f64)length / ns);
+    free_keys(&whole);
+}
+
+i32 main(i32 argc, char *argv[])
+{
+#ifdef FAST_STRING_HASH
+    printf("hash: word at a time\n\n");
+#else
+    printf("hash: FNV-1a\n\n");
+#endif
+    printf("%-18s %8s %7s %8s %9s %8s %9s\n", "keys", "count", "ns", "bytes",
+           "linear", "groups", "tag hits");
+
+    char **texts = checked_malloc(sizeof(char *) * (size_t)argc);
+    size_t *lengths = checked_malloc(sizeof(size_t) * (size_t)argc);
+    const char **names = checked_malloc(sizeof(char *) * (size_t)argc);
+    for (i32 i = 1; i < argc; i++) {
+        texts[i] = read_file(argv[i], &lengths[i]);
+        const char *slash = strrchr(argv[i], '/');
+        names[i] = slash ? slash + 1 : argv[i];
+        struct key_set set = split_lines(names[i], texts[i], lengths[i]);
+        report(&set);
+        free_keys(&set);
+    }
+
+    struct key_set items = {"item0..item199999", NULL, 0, 0};
+    char *item_text = make_items(&items);
+    report(&items);
+    free_keys(&items);
+    free(item_text);
+
+    struct key_set words = {"random a-z words", NULL, 0, 0};
+    char *word_text = make_words(&words);
+    report(&words);
+    free_keys(&words);
+    free(word_text);
+
+    printf("\n");
+    for (i32 i = 1; i < argc; i++) {
+        report_throughput(names[i], texts[i], lengths[i]);
+        free(texts[i]);
+    }
+    free(texts);
+    free(names);
+    free(lengths);
+    printf("\nns: per hash. bytes: mean key length. linear: slots read by a "
+           "lookup at 3/4 load.\ngroups: groups of 16 read by a lookup at 7/8 "
+           "load. tag hits: other keys with\nthe same seven bits in them.\n");
+    return 0;
+}
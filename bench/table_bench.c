@@ -0,0 +1,163 @@
+// Measure struct table: lookups of keys in it and of keys not in it, and
+// churn, which deletes a key and inserts another. Each runs on a table that
+// fits in the cache and on one that does not, filled to several loads.
+//
+//   table_bench [operations]
+//
+// Times are per operation, over random keys, and include picking the key.
+// Build with WITH_SIMD_TABLE off to measure the group probe without SSE2.
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_OPERATIONS 10000000u
+
+struct bench_size {
+    size_t capacity;
+    f64 load;
+};
+
+static const struct bench_size sizes[] = {
+    {4096, 0.50},    {4096, 0.70},    {4096, 0.85},
+    {1 << 20, 0.50}, {1 << 20, 0.70}, {1 << 20, 0.85},
+};
+
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+static u64 now_ns(void)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (u64)now.tv_sec * 1000000000u + (u64)now.tv_nsec;
+}
+
+static u64 random_next(u64 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// The table only reads the hash of a key and compares keys by address, so
+// the keys are made outside the collector's heap, with the hashes of names
+// such as a program would use.
+static struct obj_string **make_keys(size_t count)
+{
+    struct obj_string **keys = malloc(sizeof(struct obj_string *) * count);
+    if (!keys)
+        exit(1);
+    for (size_t i = 0; i < count; i++) {
+        char name[32];
+        const i32 length = snprintf(name, sizeof(name), "key%zu", i);
+        keys[i] = calloc(1, sizeof(struct obj_string) + 1);
+        if (!keys[i])
+            exit(1);
+        keys[i]->obj.type = OBJ_STRING;
+        keys[i]->hash = hash_string(name, (size_t)length);
+    }
+    return keys;
+}
+
+// Look up random keys among the count keys from first on.
+static f64 time_lookups(const struct table *table, struct obj_string **keys,
+                        size_t first, size_t count, size_t operations)
+{
+    u64 state = 0x9e3779b97f4a7c15u;
+    size_t found = 0;
+    const u64 start = now_ns();
+    for (size_t i = 0; i < operations; i++) {
+        value_ty value;
+        found += table_get(table, keys[first + random_next(&state) % count],
+                           &value);
+    }
+    const u64 elapsed = now_ns() - start;
+
+    // Keep the compiler from dropping the lookups.
+    if (found == 1)
+        fputc('\0', stderr);
+    return (f64)elapsed / (f64)operations;
+}
+
+// Swap a random key in the table with a random one out of it. The keys in
+// the table are kept at the front of the array.
+static f64 time_churn(struct table *table, struct obj_string **keys,
+                      size_t live_count, size_t dead_count,
+                      size_t operations)
+{
+    u64 state = 0x2545f4914f6cdd1du;
+    const u64 start = now_ns();
+    for (size_t i = 0; i < operations; i++) {
+        const size_t live = random_next(&state) % live_count;
+        const size_t dead = live_count + random_next(&state) % dead_count;
+        table_delete(table, keys[live]);
+        table_set(table, keys[dead], NIL_VAL);
+        struct obj_string *key = keys[live];
+        keys[live] = keys[dead];
+        keys[dead] = key;
+    }
+    return (f64)(now_ns() - start) / (f64)operations;
+}
+
+static void run(const struct bench_size *size, size_t operations)
+{
+    const size_t live_count = (size_t)((f64)size->capacity * size->load);
+    const size_t dead_count = live_count;
+    struct obj_string **keys = make_keys(live_count + dead_count);
+
+    struct table table;
+    table_init(&table);
+    for (size_t i = 0; i < live_count; i++) {
+        table_set(&table, keys[i], NUMBER_VAL((f64)i));
+    }
+    const size_t capacity = table.capacity;
+
+    const f64 hit = time_lookups(&table, keys, 0, live_count, operations);
+    const f64 miss =
+        time_lookups(&table, keys, live_count, dead_count, operations);
+    const f64 churn =
+        time_churn(&table, keys, live_count, dead_count, operations);
+    printf("%8zu %9zu %5.2f %8.1f %8.1f %8.1f %9zu\n", live_count, capacity,
+           (f64)live_count / (f64)capacity, hit, miss, churn, table.capacity);
+
+    table_free(&table);
+    for (size_t i = 0; i < live_count + dead_count; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+i32 main(i32 argc, char *argv[])
+{
+    size_t operations = DEFAULT_OPERATIONS;
+    if (argc > 1)
+        operations = strtoull(argv[1], NULL, 10);
+    if (argc > 2 || operations == 0) {
+        fprintf(stderr, "Usage: table_bench [operations]\n");
+        return 64;
+    }
+
+    // The tables allocate through the collector, which is kept from running.
+    vm_init();
+    gc_tune(GC_INITIAL_HEAP, (f64)(SIZE_MAX / 4));
+
+#if defined(SIMD_TABLE) && defined(__SSE2__)
+    printf("groups: SSE2, %zu operations\n\n", operations);
+#else
+    printf("groups: word arithmetic, %zu operations\n\n", operations);
+#endif
+    printf("%8s %9s %5s %8s %8s %8s %9s\n", "keys", "capacity", "load",
+           "hit", "miss", "churn", "churned");
+    for (size_t i = 0; i < SIZE_COUNT; i++) {
+        run(&sizes[i], operations);
+    }
+    printf("\nhit, miss, churn: ns per operation. churned: the capacity after "
+           "the churn.\n");
+
+    vm_free();
+    return 0;
+}
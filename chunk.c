@@ -12,6 +12,12 @@ void chunk_init(struct chunk *chunk)
     chunk->lines = NULL;
     chunk->line_count = 0;
     chunk->line_capacity = 0;
+    chunk->property_caches = NULL;
+    chunk->property_cache_count = 0;
+    chunk->property_cache_capacity = 0;
+    chunk->invoke_caches = NULL;
+    chunk->invoke_cache_count = 0;
+    chunk->invoke_cache_capacity = 0;
     value_array_init(&chunk->constants);
 }
 
@@ -46,6 +52,10 @@ void chunk_free(struct chunk *chunk)
 {
     FREE_ARRAY(u8, chunk->code, chunk->capacity);
     FREE_ARRAY(struct line_start, chunk->lines, chunk->line_capacity);
+    FREE_ARRAY(struct property_cache, chunk->property_caches,
+               chunk->property_cache_capacity);
+    FREE_ARRAY(struct invoke_cache, chunk->invoke_caches,
+               chunk->invoke_cache_capacity);
     value_array_free(&chunk->constants);
     chunk_init(chunk);
 }
@@ -70,10 +80,107 @@ size_t chunk_getline(const struct chunk *chunk, size_t instruction)
     }
 }
 
+size_t chunk_instruction_length(const struct chunk *chunk, size_t offset)
+{
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_POPN:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+        return 2;
+    case OP_GET_LOCAL_WIDE:
+    case OP_SET_LOCAL_WIDE:
+    case OP_GET_UPVALUE_WIDE:
+    case OP_SET_UPVALUE_WIDE:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_JUMP_IF_TRUE_LONG:
+    case OP_LOOP_LONG:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+        return 4;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+        return 6;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return 7;
+    case OP_CLOSURE: {
+        const u32 constant = (u32)((chunk->code[offset + 1] << 16) |
+                                   (chunk->code[offset + 2] << 8) |
+                                   chunk->code[offset + 3]);
+        const struct obj_function *fn =
+            AS_FUNCTION(chunk->constants.values[constant]);
+        // Each upvalue is an is_local byte and a 16-bit index.
+        return 4 + (size_t)fn->upvalue_count * 3;
+    }
+    default:
+        return 1;
+    }
+}
+
 size_t chunk_add_constant(struct chunk *chunk, value_ty v)
 {
     push(v);
+    heap_lock();
     value_array_write(&chunk->constants, v);
+    heap_unlock();
     pop();
     return chunk->constants.count - 1;
 }
+
+size_t chunk_add_property_cache(struct chunk *chunk)
+{
+    if (chunk->property_cache_capacity < chunk->property_cache_count + 1) {
+        const size_t old_capacity = chunk->property_cache_capacity;
+        chunk->property_cache_capacity = GROW_CAPACITY(old_capacity);
+        chunk->property_caches =
+            GROW_ARRAY(struct property_cache, chunk->property_caches,
+                       old_capacity, chunk->property_cache_capacity);
+    }
+
+    struct property_cache *cache =
+        &chunk->property_caches[chunk->property_cache_count++];
+    cache->shape = NULL;
+    cache->transition = NULL;
+    cache->slot = 0;
+    cache->misses = 0;
+    cache->megamorphic = false;
+    return chunk->property_cache_count - 1;
+}
+
+size_t chunk_add_invoke_cache(struct chunk *chunk)
+{
+    heap_lock();
+    if (chunk->invoke_cache_capacity < chunk->invoke_cache_count + 1) {
+        const size_t old_capacity = chunk->invoke_cache_capacity;
+        chunk->invoke_cache_capacity = GROW_CAPACITY(old_capacity);
+        chunk->invoke_caches =
+            GROW_ARRAY(struct invoke_cache, chunk->invoke_caches,
+                       old_capacity, chunk->invoke_cache_capacity);
+    }
+
+    struct invoke_cache *cache =
+        &chunk->invoke_caches[chunk->invoke_cache_count++];
+    cache->slot = INVOKE_NO_SLOT;
+    cache->count = 0;
+    cache->megamorphic = false;
+    heap_unlock();
+    return chunk->invoke_cache_count - 1;
+}
@@ -4,19 +4,34 @@
 #include "common.h"
 #include "value.h"
 
+// Operands are big-endian. Variants suffixed _WIDE take a 16-bit operand in
+// place of a byte and those suffixed _LONG a 24-bit one. Each directly
+// follows its compact form, and the compiler only emits it when the index or
+// jump does not fit the compact one.
+// Constant indices of instructions off the hot path (names, functions) are
+// always 24-bit.
 enum op_code {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_POP,
+    OP_POPN,
     OP_GET_LOCAL,
+    OP_GET_LOCAL_WIDE,
     OP_SET_LOCAL,
+    OP_SET_LOCAL_WIDE,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
     OP_GET_UPVALUE,
+    OP_GET_UPVALUE_WIDE,
     OP_SET_UPVALUE,
+    OP_SET_UPVALUE_WIDE,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
@@ -31,8 +46,13 @@ enum op_code {
     OP_NEGATE,
     OP_PRINT,
     OP_JUMP,
+    OP_JUMP_LONG,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_JUMP_IF_TRUE,
+    OP_JUMP_IF_TRUE_LONG,
     OP_LOOP,
+    OP_LOOP_LONG,
     OP_CALL,
     OP_INVOKE,
     OP_SUPER_INVOKE,
@@ -42,6 +62,62 @@ enum op_code {
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+    // Type-specialized forms the VM rewrites generic instructions into
+    // after executing them. The compiler never emits these.
+    OP_EQUAL_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+};
+
+struct obj_class;
+struct obj_closure;
+struct shape;
+
+#define INVOKE_CACHE_SIZE 4
+#define INVOKE_NO_SLOT UINT32_MAX
+
+/**
+ * Monomorphic inline cache of a property access site.
+ * A site that keeps seeing new shapes goes megamorphic and stops caching.
+ */
+struct property_cache {
+    // Receiver shape the cached slot is valid for.
+    struct shape *shape;
+    // For stores that add a field, the receiver's shape afterwards.
+    struct shape *transition;
+    size_t slot;
+    u8 misses;
+    bool megamorphic;
+};
+
+struct invoke_cache_entry {
+    struct obj_class *klass;
+    // Receiver shape, which proves no field shadows the method.
+    // NULL for super calls, which never look at fields.
+    struct shape *shape;
+    // The class's method_version when the entry was filled.
+    u32 version;
+    struct obj_closure *method;
+};
+
+/**
+ * Polymorphic inline cache of a method call site, mapping receiver classes
+ * to the closure they resolve the method to.
+ * A site that sees more than INVOKE_CACHE_SIZE receivers goes megamorphic
+ * and stops caching.
+ */
+struct invoke_cache {
+    struct invoke_cache_entry entries[INVOKE_CACHE_SIZE];
+    // The vtable slot the method was last found in, which holds it in every
+    // subclass of that class too, or INVOKE_NO_SLOT.
+    u32 slot;
+    u8 count;
+    bool megamorphic;
 };
 
 struct line_start {
@@ -57,6 +133,12 @@ struct chunk {
     struct line_start *lines;
     size_t line_count;
     size_t line_capacity;
+    struct property_cache *property_caches;
+    size_t property_cache_count;
+    size_t property_cache_capacity;
+    struct invoke_cache *invoke_caches;
+    size_t invoke_cache_count;
+    size_t invoke_cache_capacity;
 };
 
 void chunk_init(struct chunk *chunk);
@@ -64,10 +146,28 @@ void chunk_write(struct chunk *chunk, u8 byte, size_t line);
 void chunk_free(struct chunk *chunk);
 size_t chunk_getline(const struct chunk *chunk, size_t instruction);
 
+/**
+ * Decode the size of the instruction starting at offset, operands included.
+ * @return The offset of the next instruction minus offset.
+ */
+size_t chunk_instruction_length(const struct chunk *chunk, size_t offset);
+
 /**
  * Add a constant to the chunk.
  * @return The index of the added constant in the constants array.
  */
 size_t chunk_add_constant(struct chunk *chunk, value_ty v);
 
+/**
+ * Add an empty property cache to the chunk.
+ * @return The index of the added cache in the property_caches array.
+ */
+size_t chunk_add_property_cache(struct chunk *chunk);
+
+/**
+ * Add an empty invoke cache to the chunk.
+ * @return The index of the added cache in the invoke_caches array.
+ */
+size_t chunk_add_invoke_cache(struct chunk *chunk);
+
 #endif // CLOX__CHUNK_H_
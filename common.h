@@ -9,6 +9,8 @@
 #include <stdio.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_MAX 0xffffff
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -4,8 +4,10 @@
 #include "common.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,6 +15,8 @@
 #include "debug.h"
 #endif
 
+#define CONSTANT_MAP_MAX_LOAD 0.75
+
 struct parser {
     struct token current;
     struct token previous;
@@ -48,10 +52,14 @@ struct local {
     struct token name;
     i32 depth;
     bool is_captured;
+    // Set for locals initialized with a constant and never assigned, whose
+    // reads compile to the value itself.
+    bool is_constant;
+    value_ty value;
 };
 
 struct upvalue {
-    u8 index;
+    u16 index;
     bool is_local;
 };
 
@@ -62,15 +70,51 @@ enum function_type {
     TYPE_SCRIPT
 };
 
+/**
+ * Where each number and string in the constant pool of a chunk is, so that
+ * make_constant() finds an existing entry without scanning the pool. An
+ * open-addressed hash map with linear probing, keyed by the hash of the
+ * value. Entries for constants that a fold dropped from the pool are left
+ * in place and told apart by looking at the pool.
+ */
+struct constant_map {
+    size_t count;
+    size_t capacity;
+    // Zero marks an empty slot, so a hash of zero is stored as one.
+    u32 *hashes;
+    u32 *indices;
+};
+
+// The names assigned from some point of a block to its end, sorted so that
+// a name is found by binary search.
+struct assigned_names {
+    bool scanned;
+    struct token *names;
+    i32 count;
+    i32 capacity;
+};
+
 struct compiler {
     struct compiler *enclosing;
     struct obj_function *fn;
     enum function_type fn_type;
+    struct constant_map constant_map;
+    // Indexed by scope depth. The names of a block are gathered by a single
+    // scan ahead, when it declares its first constant local.
+    struct assigned_names *assigned;
+    i32 assigned_capacity;
 
-    struct local locals[UINT8_COUNT];
+    struct local *locals;
     i32 local_count;
-    struct upvalue upvalues[UINT8_COUNT];
+    i32 local_capacity;
+    struct upvalue *upvalues;
+    i32 upvalue_capacity;
     i32 scope_depth;
+
+    // Where the left operand of the infix expression being compiled starts,
+    // in the code and in the constant pool.
+    size_t operand_start;
+    size_t operand_constants;
 };
 
 struct class_compiler {
@@ -164,24 +208,44 @@ static void emit_bytes(u8 byte1, u8 byte2)
     emit_byte(byte2);
 }
 
+static void emit_short(u16 value)
+{
+    emit_byte((u8)(value >> 8));
+    emit_byte((u8)value);
+}
+
+static void emit_long(u32 value)
+{
+    emit_byte((u8)(value >> 16));
+    emit_byte((u8)(value >> 8));
+    emit_byte((u8)value);
+}
+
 static void emit_loop(size_t loop_start)
 {
-    emit_byte(OP_LOOP);
+    const size_t offset = current_chunk()->size - loop_start + 3;
+    if (offset <= UINT16_MAX) {
+        emit_byte(OP_LOOP);
+        emit_short((u16)offset);
+        return;
+    }
 
-    const size_t offset = current_chunk()->size - loop_start + 2;
-    if (offset > UINT16_MAX)
+    if (offset + 1 > UINT24_MAX)
         error("Loop body too large.");
 
-    emit_byte((offset >> 8) & 0xff);
-    emit_byte(offset & 0xff);
+    emit_byte(OP_LOOP_LONG);
+    emit_long((u32)(offset + 1));
 }
 
+// Forward jumps are emitted in the long form, since the distance is not known
+// yet. optimize_chunk() shrinks the ones that fit in 16 bits.
 static size_t emit_jump(u8 instruction)
 {
     emit_byte(instruction);
     emit_byte(0xff);
     emit_byte(0xff);
-    return current_chunk()->size - 2;
+    emit_byte(0xff);
+    return current_chunk()->size - 3;
 }
 
 static void emit_return(void)
@@ -196,32 +260,265 @@ static void emit_return(void)
     emit_byte(OP_RETURN);
 }
 
-static u8 make_constant(value_ty value)
+static bool same_constant(value_ty a, value_ty b)
+{
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type)
+        return false;
+    // Bitwise, so that 0 and -0 stay apart and NaNs are shared.
+    if (IS_NUMBER(a))
+        return memcmp(&a.as.number, &b.as.number, sizeof(f64)) == 0;
+    return values_equal(a, b);
+#endif
+}
+
+// Strings hash by their characters, which they already carry, and numbers
+// by their bits. Other objects are never shared between constants.
+static bool constant_hash(value_ty value, u32 *hash)
+{
+    if (IS_STRING(value)) {
+        *hash = AS_STRING(value)->hash;
+    } else if (IS_NUMBER(value)) {
+        const f64 number = AS_NUMBER(value);
+        u64 bits;
+        memcpy(&bits, &number, sizeof(bits));
+        bits = (bits ^ (bits >> 32)) * 0x9e3779b97f4a7c15u;
+        *hash = (u32)(bits >> 32);
+    } else {
+        return false;
+    }
+    *hash = *hash ? *hash : 1;
+    return true;
+}
+
+static void constant_map_init(struct constant_map *map)
+{
+    map->count = 0;
+    map->capacity = 0;
+    map->hashes = NULL;
+    map->indices = NULL;
+}
+
+static void constant_map_free(struct constant_map *map)
+{
+    FREE_ARRAY(u32, map->hashes, map->capacity);
+    FREE_ARRAY(u32, map->indices, map->capacity);
+    constant_map_init(map);
+}
+
+static void free_assigned_names(struct compiler *compiler)
+{
+    for (i32 i = 0; i < compiler->assigned_capacity; i++) {
+        FREE_ARRAY(struct token, compiler->assigned[i].names,
+                   (size_t)compiler->assigned[i].capacity);
+    }
+    FREE_ARRAY(struct assigned_names, compiler->assigned,
+               (size_t)compiler->assigned_capacity);
+}
+
+static void constant_map_insert(struct constant_map *map, u32 hash, u32 index)
+{
+    const size_t mask = map->capacity - 1;
+    size_t slot = hash & mask;
+    while (map->hashes[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    map->hashes[slot] = hash;
+    map->indices[slot] = index;
+    map->count++;
+}
+
+// Rebuild the map at twice its capacity, leaving out the entries whose
+// constants are no longer in the pool.
+static void constant_map_grow(struct constant_map *map,
+                              const struct value_array *constants)
+{
+    const size_t old_capacity = map->capacity;
+    u32 *old_hashes = map->hashes;
+    u32 *old_indices = map->indices;
+
+    map->capacity = GROW_CAPACITY(old_capacity);
+    map->hashes = ALLOCATE(u32, map->capacity);
+    map->indices = ALLOCATE(u32, map->capacity);
+    memset(map->hashes, 0, sizeof(u32) * map->capacity);
+    map->count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        u32 hash;
+        if (old_hashes[i] != 0 && old_indices[i] < constants->count &&
+            constant_hash(constants->values[old_indices[i]], &hash) &&
+            hash == old_hashes[i])
+            constant_map_insert(map, hash, old_indices[i]);
+    }
+
+    FREE_ARRAY(u32, old_hashes, old_capacity);
+    FREE_ARRAY(u32, old_indices, old_capacity);
+}
+
+/**
+ * Find the value among the first count constants of the pool.
+ * @return Its index, or -1 if it is not there.
+ */
+static i32 find_constant(value_ty value, size_t count)
+{
+    const struct constant_map *map = &current->constant_map;
+    u32 hash;
+    if (map->count == 0 || !constant_hash(value, &hash))
+        return -1;
+
+    const struct value_array *constants = &current_chunk()->constants;
+    const size_t mask = map->capacity - 1;
+    for (size_t slot = hash & mask; map->hashes[slot] != 0;
+         slot = (slot + 1) & mask) {
+        const u32 index = map->indices[slot];
+        if (map->hashes[slot] == hash && index < count &&
+            same_constant(constants->values[index], value))
+            return (i32)index;
+    }
+    return -1;
+}
+
+static u32 make_constant(value_ty value)
 {
+    const i32 existing =
+        find_constant(value, current_chunk()->constants.count);
+    if (existing != -1)
+        return (u32)existing;
+
     const size_t constant = chunk_add_constant(current_chunk(), value);
-    if (constant > UINT8_MAX) {
+    write_barrier(&current->fn->obj, NIL_VAL, value);
+    if (constant > UINT24_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (u8)constant;
+    u32 hash;
+    if (constant_hash(value, &hash)) {
+        struct constant_map *map = &current->constant_map;
+        if ((f64)(map->count + 1) > (f64)map->capacity * CONSTANT_MAP_MAX_LOAD)
+            constant_map_grow(map, &current_chunk()->constants);
+        constant_map_insert(map, hash, (u32)constant);
+    }
+    return (u32)constant;
 }
 
 static void emit_constant(value_ty value)
 {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+    const u32 constant = make_constant(value);
+    if (constant <= UINT8_MAX) {
+        emit_bytes(OP_CONSTANT, (u8)constant);
+    } else {
+        emit_byte(OP_CONSTANT_LONG);
+        emit_long(constant);
+    }
+}
+
+static void emit_value(value_ty value)
+{
+    if (IS_NIL(value)) {
+        emit_byte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emit_constant(value);
+    }
+}
+
+/**
+ * Check whether the code emitted since start loads a single constant.
+ * @return true and the constant in value if so.
+ */
+static bool constant_at(size_t start, value_ty *value)
+{
+    const struct chunk *chunk = current_chunk();
+    const size_t size = chunk->size - start;
+
+    if (size == 1) {
+        switch (chunk->code[start]) {
+        case OP_NIL:
+            *value = NIL_VAL;
+            return true;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return true;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    if (size == 2 && chunk->code[start] == OP_CONSTANT) {
+        *value = chunk->constants.values[chunk->code[start + 1]];
+        return true;
+    }
+
+    if (size == 4 && chunk->code[start] == OP_CONSTANT_LONG) {
+        const u8 *operand = &chunk->code[start + 1];
+        *value = chunk->constants.values[(operand[0] << 16) |
+                                         (operand[1] << 8) | operand[2]];
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Replace the constant operands emitted since start with their folded value.
+ * Only the operands referenced the constants added since constants, so
+ * those are dropped too.
+ * @return false, leaving the code alone, if value does not fit in the
+ * constant pool.
+ */
+static bool fold_constant(size_t start, size_t constants, value_ty value)
+{
+    struct chunk *chunk = current_chunk();
+
+    if (!IS_NIL(value) && !IS_BOOL(value) &&
+        find_constant(value, constants) == -1 && constants > UINT24_MAX)
+        return false;
+
+    chunk->size = start;
+    while (chunk->line_count > 0 &&
+           chunk->lines[chunk->line_count - 1].offset >= start)
+        chunk->line_count--;
+    heap_lock();
+    chunk->constants.count = constants;
+    heap_unlock();
+
+    emit_value(value);
+    return true;
 }
 
 static void patch_jump(size_t offset)
 {
     const struct chunk *cc = current_chunk();
-    const size_t jump = cc->size - offset - 2;
+    const size_t jump = cc->size - offset - 3;
 
-    if (jump > UINT16_MAX)
+    if (jump > UINT24_MAX)
         error("Too much code to jump over.");
 
-    cc->code[offset] = (jump >> 8) & 0xff;
-    cc->code[offset + 1] = jump & 0xff;
+    cc->code[offset] = (jump >> 16) & 0xff;
+    cc->code[offset + 1] = (jump >> 8) & 0xff;
+    cc->code[offset + 2] = jump & 0xff;
+}
+
+static struct local *push_local(void)
+{
+    if (current->local_capacity < current->local_count + 1) {
+        const i32 old_capacity = current->local_capacity;
+        current->local_capacity = GROW_CAPACITY(old_capacity);
+        current->locals =
+            GROW_ARRAY(struct local, current->locals, (size_t)old_capacity,
+                       (size_t)current->local_capacity);
+    }
+
+    struct local *local = &current->locals[current->local_count++];
+    if (current->local_count > current->fn->max_locals)
+        current->fn->max_locals = current->local_count;
+    return local;
 }
 
 static void compiler_init(struct compiler *compiler, enum function_type type)
@@ -229,18 +526,30 @@ static void compiler_init(struct compiler *compiler, enum function_type type)
     compiler->enclosing = current;
     compiler->fn = NULL;
     compiler->fn_type = type;
+    constant_map_init(&compiler->constant_map);
+    compiler->assigned = NULL;
+    compiler->assigned_capacity = 0;
+    compiler->locals = NULL;
     compiler->local_count = 0;
+    compiler->local_capacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalue_capacity = 0;
     compiler->scope_depth = 0;
     compiler->fn = alloc_function();
     current = compiler;
     if (type != TYPE_SCRIPT) {
-        current->fn->name =
+        const struct obj_string *name =
             copy_string(parser.previous.start, parser.previous.length);
+        heap_lock();
+        current->fn->name = name;
+        heap_unlock();
+        write_barrier(&current->fn->obj, NIL_VAL, OBJ_VAL(name));
     }
 
-    struct local *local = &current->locals[current->local_count++];
+    struct local *local = push_local();
     local->depth = 0;
     local->is_captured = false;
+    local->is_constant = false;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -255,6 +564,9 @@ static struct obj_function *end_compiler(void)
     emit_return();
     struct obj_function *fn = current->fn;
 
+    if (!parser.had_error)
+        optimize_chunk(current_chunk());
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error) {
         disassemble_chunk(current_chunk(),
@@ -266,6 +578,15 @@ static struct obj_function *end_compiler(void)
     return fn;
 }
 
+static void compiler_free(struct compiler *compiler)
+{
+    constant_map_free(&compiler->constant_map);
+    free_assigned_names(compiler);
+    FREE_ARRAY(struct local, compiler->locals, (size_t)compiler->local_capacity);
+    FREE_ARRAY(struct upvalue, compiler->upvalues,
+               (size_t)compiler->upvalue_capacity);
+}
+
 static void begin_scope(void)
 {
     current->scope_depth++;
@@ -273,6 +594,11 @@ static void begin_scope(void)
 
 static void end_scope(void)
 {
+    // A block at this depth that comes later is scanned anew.
+    if (current->scope_depth < current->assigned_capacity) {
+        current->assigned[current->scope_depth].scanned = false;
+        current->assigned[current->scope_depth].count = 0;
+    }
     current->scope_depth--;
 
     // Pop the locals that were declared in this scope
@@ -282,8 +608,7 @@ static void end_scope(void)
         if (current->locals[current->local_count - 1].is_captured) {
             emit_byte(OP_CLOSE_UPVALUE);
         } else {
-            // TODO: Instead of popping one by one, we could have an OP_POPN instruction,
-            // that pops N values from the stack.
+            // optimize_chunk() merges runs of these into OP_POPN.
             emit_byte(OP_POP);
         }
         current->local_count--;
@@ -295,18 +620,99 @@ static void parse_precedence(enum precedence prec);
 static void expression(void);
 static void statement(void);
 static void declaration(void);
-static u8 identifier_constant(const struct token *name);
+static u32 identifier_constant(const struct token *name);
+static u32 global_variable(const struct token *name);
 static i32 resolve_local(const struct compiler *compiler,
                          const struct token *name);
 static u8 argument_list(void);
 
+static bool is_falsey_constant(value_ty value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Evaluate a binary operator on constant operands the way the VM would.
+// Operands the VM would raise a runtime error for are left unfolded.
+static bool fold_binary(enum token_type operator_type, value_ty a, value_ty b,
+                        value_ty *result)
+{
+    switch (operator_type) {
+    case TOKEN_BANG_EQUAL:
+        *result = BOOL_VAL(!values_equal(a, b));
+        return true;
+    case TOKEN_EQUAL_EQUAL:
+        *result = BOOL_VAL(values_equal(a, b));
+        return true;
+    case TOKEN_PLUS:
+        if (IS_STRING(a) && IS_STRING(b)) {
+            const struct obj_string *x = AS_STRING(a);
+            const struct obj_string *y = AS_STRING(b);
+            struct obj_string *string = alloc_string(x->length + y->length);
+            memcpy(string->chars, x->chars, x->length);
+            memcpy(string->chars + x->length, y->chars, y->length);
+            *result = OBJ_VAL(intern_string(string));
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    const f64 x = AS_NUMBER(a);
+    const f64 y = AS_NUMBER(b);
+    switch (operator_type) {
+    case TOKEN_GREATER:
+        *result = BOOL_VAL(x > y);
+        return true;
+    case TOKEN_GREATER_EQUAL:
+        *result = BOOL_VAL(!(x < y));
+        return true;
+    case TOKEN_LESS:
+        *result = BOOL_VAL(x < y);
+        return true;
+    case TOKEN_LESS_EQUAL:
+        *result = BOOL_VAL(!(x > y));
+        return true;
+    case TOKEN_PLUS:
+        *result = NUMBER_VAL(x + y);
+        return true;
+    case TOKEN_MINUS:
+        *result = NUMBER_VAL(x - y);
+        return true;
+    case TOKEN_STAR:
+        *result = NUMBER_VAL(x * y);
+        return true;
+    case TOKEN_SLASH:
+        *result = NUMBER_VAL(x / y);
+        return true;
+    default:
+        return false;
+    }
+}
+
 static void binary(bool can_assign)
 {
     (void)can_assign;
     const enum token_type operator_type = parser.previous.type;
     const struct parse_rule *rule = get_rule(operator_type);
+    const size_t left_start = current->operand_start;
+    const size_t left_constants = current->operand_constants;
+    const size_t right_start = current_chunk()->size;
+
+    value_ty a;
+    value_ty b;
+    value_ty result;
+    const bool left_constant = constant_at(left_start, &a);
     parse_precedence(rule->precedence + 1);
 
+    if (left_constant && constant_at(right_start, &b) &&
+        fold_binary(operator_type, a, b, &result) &&
+        fold_constant(left_start, left_constants, result))
+        return;
+
     switch (operator_type) {
     case TOKEN_BANG_EQUAL:
         emit_bytes(OP_EQUAL, OP_NOT);
@@ -350,20 +756,44 @@ static void call(bool can_assign)
     emit_bytes(OP_CALL, n_args);
 }
 
+static void emit_property(u8 instruction, u32 name)
+{
+    const size_t cache = chunk_add_property_cache(current_chunk());
+    if (cache > UINT16_MAX)
+        error("Too many property accesses in one chunk.");
+
+    emit_byte(instruction);
+    emit_long(name);
+    emit_byte((cache >> 8) & 0xff);
+    emit_byte(cache & 0xff);
+}
+
+static void emit_invoke(u8 instruction, u32 name, u8 n_args)
+{
+    const size_t cache = chunk_add_invoke_cache(current_chunk());
+    if (cache > UINT16_MAX)
+        error("Too many method calls in one chunk.");
+
+    emit_byte(instruction);
+    emit_long(name);
+    emit_byte(n_args);
+    emit_byte((cache >> 8) & 0xff);
+    emit_byte(cache & 0xff);
+}
+
 static void dot(bool can_assign)
 {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    const u8 name = identifier_constant(&parser.previous);
+    const u32 name = identifier_constant(&parser.previous);
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(OP_SET_PROPERTY, name);
+        emit_property(OP_SET_PROPERTY, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
         const u8 n_args = argument_list();
-        emit_bytes(OP_INVOKE, name);
-        emit_byte(n_args);
+        emit_invoke(OP_INVOKE, name, n_args);
     } else {
-        emit_bytes(OP_GET_PROPERTY, name);
+        emit_property(OP_GET_PROPERTY, name);
     }
 }
 
@@ -402,8 +832,8 @@ static void number(bool can_assign)
 static void or_(bool can_assign)
 {
     (void)can_assign;
-    const size_t else_jump = emit_jump(OP_JUMP_IF_FALSE);
-    const size_t end_jump = emit_jump(OP_JUMP);
+    const size_t else_jump = emit_jump(OP_JUMP_IF_FALSE_LONG);
+    const size_t end_jump = emit_jump(OP_JUMP_LONG);
 
     patch_jump(else_jump);
     emit_byte(OP_POP);
@@ -421,6 +851,32 @@ static void string(bool can_assign)
 
 static i32 resolve_upvalue(struct compiler *compiler, struct token *name);
 
+// Emit op, or its wide or long form if arg does not fit op's operand.
+static void emit_variable(u8 op, i32 arg)
+{
+    switch (op) {
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+        if (arg <= UINT16_MAX) {
+            emit_byte(op);
+            emit_short((u16)arg);
+        } else {
+            emit_byte(op + 1);
+            emit_long((u32)arg);
+        }
+        break;
+    default:
+        if (arg <= UINT8_MAX) {
+            emit_bytes(op, (u8)arg);
+        } else {
+            emit_byte(op + 1);
+            emit_short((u16)arg);
+        }
+        break;
+    }
+}
+
 static void named_variable(struct token name, bool can_assign)
 {
     u8 get_op;
@@ -434,16 +890,18 @@ static void named_variable(struct token name, bool can_assign)
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     } else {
-        arg = identifier_constant(&name);
+        arg = (i32)global_variable(&name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(set_op, (u8)arg);
+        emit_variable(set_op, arg);
+    } else if (get_op == OP_GET_LOCAL && current->locals[arg].is_constant) {
+        emit_value(current->locals[arg].value);
     } else {
-        emit_bytes(get_op, (u8)arg);
+        emit_variable(get_op, arg);
     }
 }
 
@@ -469,18 +927,18 @@ static void super_(bool can_assign)
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    const u8 name = identifier_constant(&parser.previous);
+    const u32 name = identifier_constant(&parser.previous);
 
     named_variable(synthetic_token("this"), /*can_assign=*/false);
 
     if (match(TOKEN_LEFT_PAREN)) {
         const u8 n_args = argument_list();
         named_variable(synthetic_token("super"), /*can_assign=*/false);
-        emit_bytes(OP_SUPER_INVOKE, name);
-        emit_byte(n_args);
+        emit_invoke(OP_SUPER_INVOKE, name, n_args);
     } else {
         named_variable(synthetic_token("super"), /*can_assign=*/false);
-        emit_bytes(OP_GET_SUPER, name);
+        emit_byte(OP_GET_SUPER);
+        emit_long(name);
     }
 }
 
@@ -499,9 +957,22 @@ static void unary(bool can_assign)
 {
     (void)can_assign;
     const enum token_type operator_type = parser.previous.type;
+    const size_t start = current_chunk()->size;
+    const size_t constants = current_chunk()->constants.count;
 
     parse_precedence(PREC_UNARY);
 
+    value_ty value;
+    if (constant_at(start, &value)) {
+        if (operator_type == TOKEN_BANG &&
+            fold_constant(start, constants,
+                          BOOL_VAL(is_falsey_constant(value))))
+            return;
+        if (operator_type == TOKEN_MINUS && IS_NUMBER(value) &&
+            fold_constant(start, constants, NUMBER_VAL(-AS_NUMBER(value))))
+            return;
+    }
+
     switch (operator_type) {
     case TOKEN_BANG:
         emit_byte(OP_NOT);
@@ -568,12 +1039,16 @@ static void parse_precedence(enum precedence prec)
         return;
     }
 
+    const size_t start = current_chunk()->size;
+    const size_t constants = current_chunk()->constants.count;
     const bool can_assign = prec <= PREC_ASSIGNMENT;
     prefix_rule(can_assign);
 
     while (prec <= get_rule(parser.current.type)->precedence) {
         advance();
         const parse_fn infix_rule = get_rule(parser.previous.type)->infix;
+        current->operand_start = start;
+        current->operand_constants = constants;
         infix_rule(can_assign);
     }
 
@@ -582,11 +1057,23 @@ static void parse_precedence(enum precedence prec)
     }
 }
 
-static u8 identifier_constant(const struct token *name)
+static u32 identifier_constant(const struct token *name)
 {
     return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
 }
 
+static u32 global_variable(const struct token *name)
+{
+    const size_t slot =
+        global_slot((struct obj_string *)copy_string(name->start, name->length));
+    if (slot > UINT24_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return (u32)slot;
+}
+
 static bool identifiers_equal(const struct token *a, const struct token *b)
 {
     if (a->length != b->length)
@@ -611,7 +1098,7 @@ static i32 resolve_local(const struct compiler *compiler,
     return -1;
 }
 
-static i32 add_upvalue(struct compiler *compiler, u8 index, bool is_local)
+static i32 add_upvalue(struct compiler *compiler, u16 index, bool is_local)
 {
     const i32 upvalue_count = compiler->fn->upvalue_count;
 
@@ -622,11 +1109,19 @@ static i32 add_upvalue(struct compiler *compiler, u8 index, bool is_local)
         }
     }
 
-    if (upvalue_count == UINT8_COUNT) {
+    if (upvalue_count == UINT16_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
 
+    if (compiler->upvalue_capacity < upvalue_count + 1) {
+        const i32 old_capacity = compiler->upvalue_capacity;
+        compiler->upvalue_capacity = GROW_CAPACITY(old_capacity);
+        compiler->upvalues = GROW_ARRAY(struct upvalue, compiler->upvalues,
+                                        (size_t)old_capacity,
+                                        (size_t)compiler->upvalue_capacity);
+    }
+
     compiler->upvalues[upvalue_count].is_local = is_local;
     compiler->upvalues[upvalue_count].index = index;
     return compiler->fn->upvalue_count++;
@@ -641,14 +1136,14 @@ static i32 resolve_upvalue(struct compiler *compiler, struct token *name)
     const i32 local = resolve_local(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (u8)local, true);
+        return add_upvalue(compiler, (u16)local, true);
     }
 
     // The local variable wasn't found in the immediate enclosing function.
     // It must be an upvalue, recursively search through the enclosing functions.
     const i32 upvalue = resolve_upvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return add_upvalue(current, (u8)upvalue, false);
+        return add_upvalue(current, (u16)upvalue, false);
     }
 
     return -1;
@@ -656,15 +1151,16 @@ static i32 resolve_upvalue(struct compiler *compiler, struct token *name)
 
 static void add_local(struct token name)
 {
-    if (current->local_count == UINT8_COUNT) {
-        error("Too many local variables in function. Maximum is 256.");
+    if (current->local_count == UINT16_COUNT) {
+        error("Too many local variables in function. Maximum is 65536.");
         return;
     }
 
-    struct local *local = &current->locals[current->local_count++];
+    struct local *local = push_local();
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
+    local->is_constant = false;
 }
 
 static void declare_variable(void)
@@ -684,18 +1180,18 @@ static void declare_variable(void)
     add_local(*name);
 }
 
-static u8 parse_variable(const char *error_msg)
+static u32 parse_variable(const char *error_msg)
 {
     consume(TOKEN_IDENTIFIER, error_msg);
 
     declare_variable();
     // At runtime, locals aren’t looked up by name.
-    // There’s no need to stuff the variable’s name into the constant table,
-    // so if the declaration is inside a local scope, we return a dummy table index instead.
+    // There’s no need to resolve a global slot for the variable,
+    // so if the declaration is inside a local scope, we return a dummy slot instead.
     if (current->scope_depth > 0)
         return 0;
 
-    return identifier_constant(&parser.previous);
+    return global_variable(&parser.previous);
 }
 
 static void mark_initialized(void)
@@ -706,7 +1202,7 @@ static void mark_initialized(void)
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_variable(u8 global)
+static void define_variable(u32 global)
 {
     // Local scope, no need to define a global variable
     if (current->scope_depth > 0) {
@@ -714,7 +1210,7 @@ static void define_variable(u8 global)
         return;
     }
 
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_variable(OP_DEFINE_GLOBAL, (i32)global);
 }
 
 static u8 argument_list(void)
@@ -736,7 +1232,7 @@ static u8 argument_list(void)
 static void and_(bool can_assign)
 {
     (void)can_assign;
-    const size_t end_jump = emit_jump(OP_JUMP_IF_FALSE);
+    const size_t end_jump = emit_jump(OP_JUMP_IF_FALSE_LONG);
 
     emit_byte(OP_POP);
     parse_precedence(PREC_AND);
@@ -776,8 +1272,8 @@ static void function(enum function_type type)
             if (current->fn->arity > 255) {
                 error("Cannot have more than 255 parameters.");
             }
-            const u8 param_constant = parse_variable("Expect parameter name.");
-            define_variable(param_constant);
+            const u32 param = parse_variable("Expect parameter name.");
+            define_variable(param);
         } while (match(TOKEN_COMMA));
     }
 
@@ -786,36 +1282,45 @@ static void function(enum function_type type)
     block();
 
     struct obj_function *fn = end_compiler();
-    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(fn)));
+    // Nothing roots fn until it is in the constant pool, so add it before
+    // emitting anything that could trigger a collection.
+    const u32 constant = make_constant(OBJ_VAL(fn));
+    emit_byte(OP_CLOSURE);
+    emit_long(constant);
 
     for (i32 i = 0; i < fn->upvalue_count; i++) {
         emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+        emit_short(compiler.upvalues[i].index);
     }
+    compiler_free(&compiler);
 }
 
 static void method(void)
 {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    const u8 constant = identifier_constant(&parser.previous);
+    const u32 constant = identifier_constant(&parser.previous);
     enum function_type type = TYPE_METHOD;
     if (parser.previous.length == 4 &&
         memcmp(parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
     function(type);
-    emit_bytes(OP_METHOD, constant);
+    emit_byte(OP_METHOD);
+    emit_long(constant);
 }
 
 static void class_declaration(void)
 {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     const struct token class_name = parser.previous;
-    const u8 name_constant = identifier_constant(&parser.previous);
+    const u32 name_constant = identifier_constant(&parser.previous);
     declare_variable();
+    const u32 global =
+        current->scope_depth > 0 ? 0 : global_variable(&class_name);
 
-    emit_bytes(OP_CLASS, name_constant);
-    define_variable(name_constant);
+    emit_byte(OP_CLASS);
+    emit_long(name_constant);
+    define_variable(global);
 
     struct class_compiler class_compiler = {
         .enclosing = current_class,
@@ -856,15 +1361,102 @@ static void class_declaration(void)
 
 static void fun_declaration(void)
 {
-    const u8 global = parse_variable("Expect function name.");
+    const u32 global = parse_variable("Expect function name.");
     mark_initialized();
     function(TYPE_FUNCTION);
     define_variable(global);
 }
 
+// Scan ahead to the end of the enclosing block for an assignment to name.
+// Shadowing declarations are not tracked, so this may report assignments to
+// another variable of the same name, but never misses one.
+static i32 compare_identifiers(const void *a, const void *b)
+{
+    const struct token *x = a;
+    const struct token *y = b;
+    if (x->length != y->length)
+        return x->length < y->length ? -1 : 1;
+    return memcmp(x->start, y->start, x->length);
+}
+
+static void add_assigned_name(struct assigned_names *names,
+                              const struct token *name)
+{
+    if (names->capacity < names->count + 1) {
+        const i32 old_capacity = names->capacity;
+        names->capacity = GROW_CAPACITY(old_capacity);
+        names->names =
+            GROW_ARRAY(struct token, names->names, (size_t)old_capacity,
+                       (size_t)names->capacity);
+    }
+    names->names[names->count++] = *name;
+}
+
+// Gather the names assigned from the current token to the end of the
+// enclosing block.
+static void scan_assigned_names(struct assigned_names *names)
+{
+    const struct scanner saved = scanner_save();
+    enum token_type previous = parser.previous.type;
+    struct token token = parser.current;
+    i32 depth = 0;
+
+    while (token.type != TOKEN_EOF) {
+        if (token.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE && depth-- == 0) {
+            break;
+        }
+
+        // The initializer of a declaration assigns nothing that is already
+        // declared.
+        const struct token next = scanner_scan_token();
+        if (token.type == TOKEN_IDENTIFIER && next.type == TOKEN_EQUAL &&
+            previous != TOKEN_VAR)
+            add_assigned_name(names, &token);
+        previous = token.type;
+        token = next;
+    }
+
+    scanner_restore(saved);
+    qsort(names->names, (size_t)names->count, sizeof(struct token),
+          compare_identifiers);
+    names->scanned = true;
+}
+
+/**
+ * Check whether the name is assigned before the end of the block. The names
+ * assigned in a block are gathered when it declares its first constant
+ * local. Those assigned before a later declaration are counted too, which
+ * only means that fewer locals are propagated.
+ */
+static bool assigned_later(const struct token *name)
+{
+    if (current->assigned_capacity <= current->scope_depth) {
+        const i32 old_capacity = current->assigned_capacity;
+        current->assigned_capacity = current->scope_depth + 1;
+        current->assigned = GROW_ARRAY(
+            struct assigned_names, current->assigned, (size_t)old_capacity,
+            (size_t)current->assigned_capacity);
+        for (i32 i = old_capacity; i < current->assigned_capacity; i++) {
+            current->assigned[i].scanned = false;
+            current->assigned[i].names = NULL;
+            current->assigned[i].count = 0;
+            current->assigned[i].capacity = 0;
+        }
+    }
+
+    struct assigned_names *names = &current->assigned[current->scope_depth];
+    if (!names->scanned)
+        scan_assigned_names(names);
+    return bsearch(name, names->names, (size_t)names->count,
+                   sizeof(struct token), compare_identifiers) != NULL;
+}
+
 static void var_declaration(void)
 {
-    const u8 global = parse_variable("Expect variable name.");
+    const u32 global = parse_variable("Expect variable name.");
+    const size_t start = current_chunk()->size;
 
     if (match(TOKEN_EQUAL))
         expression();
@@ -872,6 +1464,18 @@ static void var_declaration(void)
         emit_byte(OP_NIL);
 
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    // Globals can be assigned from anywhere, only locals are propagated.
+    value_ty value;
+    if (current->scope_depth > 0 && !parser.had_error &&
+        constant_at(start, &value)) {
+        struct local *local = &current->locals[current->local_count - 1];
+        if (!assigned_later(&local->name)) {
+            local->is_constant = true;
+            local->value = value;
+        }
+    }
+
     define_variable(global);
 }
 
@@ -901,12 +1505,12 @@ static void for_statement(void)
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // jump out of the loop if the condition is false
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
+        exit_jump = emit_jump(OP_JUMP_IF_FALSE_LONG);
         emit_byte(OP_POP); // condition
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
-        const size_t body_jump = emit_jump(OP_JUMP);
+        const size_t body_jump = emit_jump(OP_JUMP_LONG);
         const size_t increment_start = current_chunk()->size;
         expression();
         emit_byte(OP_POP);
@@ -934,11 +1538,11 @@ static void if_statement(void)
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    const size_t then_jump = emit_jump(OP_JUMP_IF_FALSE);
+    const size_t then_jump = emit_jump(OP_JUMP_IF_FALSE_LONG);
     emit_byte(OP_POP);
     statement();
 
-    const size_t else_jump = emit_jump(OP_JUMP);
+    const size_t else_jump = emit_jump(OP_JUMP_LONG);
 
     patch_jump(then_jump);
     emit_byte(OP_POP);
@@ -980,7 +1584,7 @@ static void while_statement(void)
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    const size_t exit_jump = emit_jump(OP_JUMP_IF_FALSE);
+    const size_t exit_jump = emit_jump(OP_JUMP_IF_FALSE_LONG);
     emit_byte(OP_POP);
     statement();
     emit_loop(loop_start);
@@ -1068,6 +1672,7 @@ struct obj_function *compile(const char *source)
     }
 
     struct obj_function *fn = end_compiler();
+    compiler_free(&compiler);
     return parser.had_error ? NULL : fn;
 }
 
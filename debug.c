@@ -4,6 +4,7 @@
 #include "common.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 #include <stdio.h>
 
 void disassemble_chunk(const struct chunk *chunk, const char *name)
@@ -15,26 +16,59 @@ void disassemble_chunk(const struct chunk *chunk, const char *name)
         ;
 }
 
+// Read the big-endian operand of width bytes at offset.
+static u32 read_operand(const struct chunk *chunk, size_t offset, size_t width)
+{
+    u32 operand = 0;
+    for (size_t i = 0; i < width; i++) {
+        operand = (operand << 8) | chunk->code[offset + i];
+    }
+    return operand;
+}
+
 static size_t constant_instruction(const char *name, const struct chunk *chunk,
-                                   size_t offset)
+                                   size_t offset, size_t width)
 {
-    const u8 constant = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constant);
+    const u32 constant = read_operand(chunk, offset + 1, width);
+    printf("%-16s %4u '", name, constant);
     value_print(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 2;
+    return offset + 1 + width;
 }
 
 static size_t invoke_instruction(const char *name, const struct chunk *chunk,
                                  size_t offset)
 {
-    const u8 constant = chunk->code[offset + 1];
-    const u8 n_args = chunk->code[offset + 2];
+    const u32 constant = read_operand(chunk, offset + 1, 3);
+    const u8 n_args = chunk->code[offset + 4];
+    const u32 cache = read_operand(chunk, offset + 5, 2);
 
-    printf("%-16s (%d args) %4d '", name, n_args, constant);
+    printf("%-16s (%d args) %4u '", name, n_args, constant);
     value_print(chunk->constants.values[constant]);
+    printf("' (cache %u)\n", cache);
+    return offset + 7;
+}
+
+static size_t property_instruction(const char *name, const struct chunk *chunk,
+                                   size_t offset)
+{
+    const u32 constant = read_operand(chunk, offset + 1, 3);
+    const u32 cache = read_operand(chunk, offset + 4, 2);
+
+    printf("%-16s %4u '", name, constant);
+    value_print(chunk->constants.values[constant]);
+    printf("' (cache %u)\n", cache);
+    return offset + 6;
+}
+
+static size_t global_instruction(const char *name, const struct chunk *chunk,
+                                 size_t offset, size_t width)
+{
+    const u32 slot = read_operand(chunk, offset + 1, width);
+    printf("%-16s %4u '", name, slot);
+    value_print(vm.global_names.values[slot]);
     printf("'\n");
-    return offset + 3;
+    return offset + 1 + width;
 }
 
 static size_t simple_instruction(const char *name, size_t offset)
@@ -51,14 +85,23 @@ static size_t byte_instruction(const char *name, const struct chunk *chunk,
     return offset + 2;
 }
 
+static size_t short_instruction(const char *name, const struct chunk *chunk,
+                                size_t offset)
+{
+    const u32 slot = read_operand(chunk, offset + 1, 2);
+    printf("%-16s %4u\n", name, slot);
+    return offset + 3;
+}
+
 static size_t jump_instruction(const char *name, i32 sign,
-                               const struct chunk *chunk, size_t offset)
+                               const struct chunk *chunk, size_t offset,
+                               size_t width)
 {
-    u16 jump = (u16)(chunk->code[offset + 1] << 8);
-    jump |= chunk->code[offset + 2];
+    const u32 jump = read_operand(chunk, offset + 1, width);
+    const size_t next = offset + 1 + width;
     printf("%-16s %4zu -> %zu\n", name, offset,
-           offset + 3 + (size_t)sign * jump);
-    return offset + 3;
+           sign > 0 ? next + jump : next - jump);
+    return next;
 }
 
 size_t disassemble_instruction(const struct chunk *chunk, size_t offset)
@@ -75,7 +118,9 @@ size_t disassemble_instruction(const struct chunk *chunk, size_t offset)
     const u8 instruction = chunk->code[offset];
     switch (instruction) {
     case OP_CONSTANT:
-        return constant_instruction("OP_CONSTANT", chunk, offset);
+        return constant_instruction("OP_CONSTANT", chunk, offset, 1);
+    case OP_CONSTANT_LONG:
+        return constant_instruction("OP_CONSTANT_LONG", chunk, offset, 3);
     case OP_NIL:
         return simple_instruction("OP_NIL", offset);
     case OP_TRUE:
@@ -84,26 +129,42 @@ size_t disassemble_instruction(const struct chunk *chunk, size_t offset)
         return simple_instruction("OP_FALSE", offset);
     case OP_POP:
         return simple_instruction("OP_POP", offset);
+    case OP_POPN:
+        return byte_instruction("OP_POPN", chunk, offset);
     case OP_GET_LOCAL:
         return byte_instruction("OP_GET_LOCAL", chunk, offset);
+    case OP_GET_LOCAL_WIDE:
+        return short_instruction("OP_GET_LOCAL_WIDE", chunk, offset);
     case OP_SET_LOCAL:
         return byte_instruction("OP_SET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL_WIDE:
+        return short_instruction("OP_SET_LOCAL_WIDE", chunk, offset);
     case OP_GET_GLOBAL:
-        return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+        return global_instruction("OP_GET_GLOBAL", chunk, offset, 2);
+    case OP_GET_GLOBAL_LONG:
+        return global_instruction("OP_GET_GLOBAL_LONG", chunk, offset, 3);
     case OP_DEFINE_GLOBAL:
-        return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return global_instruction("OP_DEFINE_GLOBAL", chunk, offset, 2);
+    case OP_DEFINE_GLOBAL_LONG:
+        return global_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset, 3);
     case OP_SET_GLOBAL:
-        return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+        return global_instruction("OP_SET_GLOBAL", chunk, offset, 2);
+    case OP_SET_GLOBAL_LONG:
+        return global_instruction("OP_SET_GLOBAL_LONG", chunk, offset, 3);
     case OP_GET_UPVALUE:
         return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+    case OP_GET_UPVALUE_WIDE:
+        return short_instruction("OP_GET_UPVALUE_WIDE", chunk, offset);
     case OP_SET_UPVALUE:
         return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_SET_UPVALUE_WIDE:
+        return short_instruction("OP_SET_UPVALUE_WIDE", chunk, offset);
     case OP_GET_PROPERTY:
-        return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+        return property_instruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-        return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+        return property_instruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:
-        return constant_instruction("OP_GET_SUPER", chunk, offset);
+        return constant_instruction("OP_GET_SUPER", chunk, offset, 3);
     case OP_EQUAL:
         return simple_instruction("OP_EQUAL", offset);
     case OP_GREATER:
@@ -125,11 +186,21 @@ size_t disassemble_instruction(const struct chunk *chunk, size_t offset)
     case OP_PRINT:
         return simple_instruction("OP_PRINT", offset);
     case OP_JUMP:
-        return jump_instruction("OP_JUMP", 1, chunk, offset);
+        return jump_instruction("OP_JUMP", 1, chunk, offset, 2);
+    case OP_JUMP_LONG:
+        return jump_instruction("OP_JUMP_LONG", 1, chunk, offset, 3);
     case OP_JUMP_IF_FALSE:
-        return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset, 2);
+    case OP_JUMP_IF_FALSE_LONG:
+        return jump_instruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset, 3);
+    case OP_JUMP_IF_TRUE:
+        return jump_instruction("OP_JUMP_IF_TRUE", 1, chunk, offset, 2);
+    case OP_JUMP_IF_TRUE_LONG:
+        return jump_instruction("OP_JUMP_IF_TRUE_LONG", 1, chunk, offset, 3);
     case OP_LOOP:
-        return jump_instruction("OP_LOOP", -1, chunk, offset);
+        return jump_instruction("OP_LOOP", -1, chunk, offset, 2);
+    case OP_LOOP_LONG:
+        return jump_instruction("OP_LOOP_LONG", -1, chunk, offset, 3);
     case OP_CALL:
         return byte_instruction("OP_CALL", chunk, offset);
     case OP_INVOKE:
@@ -137,9 +208,9 @@ size_t disassemble_instruction(const struct chunk *chunk, size_t offset)
     case OP_SUPER_INVOKE:
         return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
     case OP_CLOSURE: {
-        offset++;
-        const u8 constant = chunk->code[offset++];
-        printf("%-16s %4d ", "OP_CLOSURE", constant);
+        const u32 constant = read_operand(chunk, offset + 1, 3);
+        offset += 4;
+        printf("%-16s %4u ", "OP_CLOSURE", constant);
         value_print(chunk->constants.values[constant]);
         printf("\n");
 
@@ -147,10 +218,11 @@ size_t disassemble_instruction(const struct chunk *chunk, size_t offset)
             AS_FUNCTION(chunk->constants.values[constant]);
 
         for (i32 i = 0; i < fn->upvalue_count; i++) {
-            const u8 is_local = chunk->code[offset++];
-            const u8 index = chunk->code[offset++];
-            printf("%04zu      |                     %s %d\n", offset - 2,
+            const u8 is_local = chunk->code[offset];
+            const u32 index = read_operand(chunk, offset + 1, 2);
+            printf("%04zu      |                     %s %u\n", offset,
                    is_local ? "local" : "upvalue", index);
+            offset += 3;
         }
         return offset;
     }
@@ -159,11 +231,27 @@ size_t disassemble_instruction(const struct chunk *chunk, size_t offset)
     case OP_RETURN:
         return simple_instruction("OP_RETURN", offset);
     case OP_CLASS:
-        return constant_instruction("OP_CLASS", chunk, offset);
+        return constant_instruction("OP_CLASS", chunk, offset, 3);
     case OP_INHERIT:
         return simple_instruction("OP_INHERIT", offset);
     case OP_METHOD:
-        return constant_instruction("OP_METHOD", chunk, offset);
+        return constant_instruction("OP_METHOD", chunk, offset, 3);
+    case OP_EQUAL_NUMBER:
+        return simple_instruction("OP_EQUAL_NUMBER", offset);
+    case OP_GREATER_NUMBER:
+        return simple_instruction("OP_GREATER_NUMBER", offset);
+    case OP_LESS_NUMBER:
+        return simple_instruction("OP_LESS_NUMBER", offset);
+    case OP_ADD_NUMBER:
+        return simple_instruction("OP_ADD_NUMBER", offset);
+    case OP_ADD_STRING:
+        return simple_instruction("OP_ADD_STRING", offset);
+    case OP_SUBTRACT_NUMBER:
+        return simple_instruction("OP_SUBTRACT_NUMBER", offset);
+    case OP_MULTIPLY_NUMBER:
+        return simple_instruction("OP_MULTIPLY_NUMBER", offset);
+    case OP_DIVIDE_NUMBER:
+        return simple_instruction("OP_DIVIDE_NUMBER", offset);
     default:
         printf("<Unknown opcode %d>\n", instruction);
         return offset + 1;
@@ -0,0 +1,178 @@
+#include "intern.h"
+
+#include "memory.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERN_MAX_LOAD 0.75
+#define INTERN_MIN_CAPACITY 8
+
+void intern_set_init(struct intern_set *set)
+{
+    set->count = 0;
+    set->capacity = 0;
+    set->hashes = NULL;
+    set->strings = NULL;
+}
+
+void intern_set_free(struct intern_set *set)
+{
+    FREE_ARRAY(u32, set->hashes, set->capacity);
+    FREE_ARRAY(struct obj_string *, set->strings, set->capacity);
+    intern_set_init(set);
+}
+
+static u32 slot_hash(u32 hash)
+{
+    return hash ? hash : 1;
+}
+
+const struct obj_string *intern_set_find(const struct intern_set *set,
+                                         const char *chars, size_t length,
+                                         u32 hash)
+{
+    if (set->count == 0)
+        return NULL;
+
+    const u32 wanted = slot_hash(hash);
+    const size_t mask = set->capacity - 1;
+    for (size_t index = hash & mask; set->hashes[index] != 0;
+         index = (index + 1) & mask) {
+        if (set->hashes[index] != wanted)
+            continue;
+
+        const struct obj_string *string = set->strings[index];
+        if (string->length == length &&
+            memcmp(string->chars, chars, length) == 0)
+            return string;
+    }
+    return NULL;
+}
+
+// Put the string in the first empty slot from its home slot on.
+static void insert(struct intern_set *set, struct obj_string *string)
+{
+    const size_t mask = set->capacity - 1;
+    size_t index = string->hash & mask;
+    while (set->hashes[index] != 0) {
+        index = (index + 1) & mask;
+    }
+    set->hashes[index] = slot_hash(string->hash);
+    set->strings[index] = string;
+    set->count++;
+}
+
+static void grow(struct intern_set *set)
+{
+    const size_t capacity = GROW_CAPACITY(set->capacity);
+    u32 *hashes = ALLOCATE(u32, capacity);
+    struct obj_string **strings = ALLOCATE(struct obj_string *, capacity);
+    memset(hashes, 0, sizeof(u32) * capacity);
+
+    // Read only now, as allocating may have run a collection that removed
+    // strings from the set.
+    struct intern_set old = *set;
+    set->count = 0;
+    set->capacity = capacity;
+    set->hashes = hashes;
+    set->strings = strings;
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.hashes[i] != 0)
+            insert(set, old.strings[i]);
+    }
+    intern_set_free(&old);
+}
+
+void intern_set_add(struct intern_set *set, struct obj_string *string)
+{
+    if ((f64)(set->count + 1) > (f64)set->capacity * INTERN_MAX_LOAD)
+        grow(set);
+    insert(set, string);
+}
+
+// Find the slot holding the string itself, or an empty one if it isn't in
+// the set.
+static size_t find_slot(const struct intern_set *set,
+                        const struct obj_string *string)
+{
+    const size_t mask = set->capacity - 1;
+    size_t index = string->hash & mask;
+    while (set->hashes[index] != 0 && set->strings[index] != string) {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+void intern_set_replace(const struct intern_set *set,
+                        const struct obj_string *string,
+                        struct obj_string *replacement)
+{
+    if (set->count == 0)
+        return;
+
+    const size_t index = find_slot(set, string);
+    if (set->hashes[index] != 0)
+        set->strings[index] = replacement;
+}
+
+void intern_set_delete(struct intern_set *set, const struct obj_string *string)
+{
+    if (set->count == 0)
+        return;
+
+    size_t hole = find_slot(set, string);
+    if (set->hashes[hole] == 0)
+        return;
+
+    // Move back each following string of the run that could not be found
+    // past the hole otherwise, which is when its home slot is not between
+    // the hole and itself.
+    const size_t mask = set->capacity - 1;
+    for (size_t index = (hole + 1) & mask; set->hashes[index] != 0;
+         index = (index + 1) & mask) {
+        const size_t home = set->strings[index]->hash & mask;
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+            set->hashes[hole] = set->hashes[index];
+            set->strings[hole] = set->strings[index];
+            hole = index;
+        }
+    }
+    set->hashes[hole] = 0;
+    set->count--;
+}
+
+void intern_set_remove_unreachable(struct intern_set *set)
+{
+    if (set->count == 0)
+        return;
+
+    // The survivors are set aside with malloc(), which cannot start a
+    // collection.
+    struct obj_string **live = malloc(sizeof(struct obj_string *) * set->count);
+    if (!live)
+        exit(1);
+
+    size_t count = 0;
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (set->hashes[i] != 0 && object_is_marked(&set->strings[i]->obj))
+            live[count++] = set->strings[i];
+    }
+
+    size_t capacity = set->capacity;
+    while (capacity > INTERN_MIN_CAPACITY && count * 4 < capacity) {
+        capacity /= 2;
+    }
+    if (capacity < set->capacity) {
+        set->hashes = GROW_ARRAY(u32, set->hashes, set->capacity, capacity);
+        set->strings = GROW_ARRAY(struct obj_string *, set->strings,
+                                  set->capacity, capacity);
+        set->capacity = capacity;
+    }
+
+    memset(set->hashes, 0, sizeof(u32) * set->capacity);
+    set->count = 0;
+    for (size_t i = 0; i < count; i++) {
+        insert(set, live[i]);
+    }
+    free(live);
+}
@@ -0,0 +1,52 @@
+#ifndef CLOX__INTERN_H_
+#define CLOX__INTERN_H_
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * The set of interned strings, an open-addressed hash set with linear
+ * probing. Hashes are kept in an array of their own next to the strings, so
+ * a probe only reads a string whose hash matches. Deleting shifts the
+ * following entries back instead of leaving tombstones.
+ */
+struct intern_set {
+    size_t count;
+    size_t capacity;
+    // Zero marks an empty slot, so a hash of zero is stored as one.
+    u32 *hashes;
+    struct obj_string **strings;
+};
+
+void intern_set_init(struct intern_set *set);
+void intern_set_free(struct intern_set *set);
+
+/**
+ * Find the interned string with the given characters.
+ * @return The string, or NULL if there is none.
+ */
+const struct obj_string *intern_set_find(const struct intern_set *set,
+                                         const char *chars, size_t length,
+                                         u32 hash);
+
+/**
+ * Add a string that is not in the set yet.
+ */
+void intern_set_add(struct intern_set *set, struct obj_string *string);
+
+/**
+ * Put replacement, a copy of string made by the collector, in its place.
+ */
+void intern_set_replace(const struct intern_set *set,
+                        const struct obj_string *string,
+                        struct obj_string *replacement);
+void intern_set_delete(struct intern_set *set, const struct obj_string *string);
+
+/**
+ * Drop the strings the major collection did not mark, rebuilding the set
+ * at a smaller capacity if it became sparse. Runs in the middle of the
+ * collection, so it never grows the set.
+ */
+void intern_set_remove_unreachable(struct intern_set *set);
+
+#endif // CLOX__INTERN_H_
@@ -1,6 +1,8 @@
+#include "memory.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static void repl(void)
 {
@@ -65,17 +67,231 @@ static void run_file(const char *path)
         exit(70);
 }
 
+static void usage(void)
+{
+    fprintf(stderr, "Usage: clox [options] [path]\n"
+                    "Options:\n"
+                    "  --gc-pause-budget=<us>  Collect the old generation "
+                    "incrementally, pausing\n"
+                    "                          for at most about <us> "
+                    "microseconds at a time\n"
+                    "  --gc-grow-factor=<x>    Start a major collection once "
+                    "the heap has grown\n"
+                    "                          <x> times larger than the "
+                    "last one left it\n"
+                    "  --gc-initial-heap=<n>   Start the first major "
+                    "collection at <n> bytes\n"
+                    "  --gc-max-heap=<n>       Start major collections at "
+                    "<n> bytes at the latest\n"
+                    "  --gc-min-interval=<n>   Allocate at least <n> bytes "
+                    "between two major\n"
+                    "                          collections\n"
+                    "  --gc-compact=<percent>  Compact the old generation "
+                    "when more than\n"
+                    "                          <percent> of its pages are "
+                    "free\n"
+#ifdef CONCURRENT_MARKING
+                    "  --gc-concurrent         Mark the old generation on a "
+                    "thread of its own\n"
+                    "                          while the program runs\n"
+#endif
+#ifdef PARALLEL_MARKING
+                    "  --gc-threads=<n>        Mark the heap on <n> threads, "
+                    "the default is one\n"
+                    "                          per CPU\n"
+#endif
+                    "  --gc-stats              Report GC pauses and time on "
+                    "exit\n"
+                    "Sizes may end in K, M or G. The GC tuning options can "
+                    "also be set through\n"
+                    "the environment variables CLOX_GC_GROW_FACTOR, "
+                    "CLOX_GC_INITIAL_HEAP,\n"
+                    "CLOX_GC_MAX_HEAP and CLOX_GC_MIN_INTERVAL.\n");
+    exit(64);
+}
+
+static void print_gc_stats(void)
+{
+    fprintf(stderr, "gc pauses: %zu, total %.3f ms, max %.3f ms\n",
+            vm.gc_pause_count,
+            (f64)vm.gc_total_pause / 1000000.0,
+            (f64)vm.gc_max_pause / 1000000.0);
+    fprintf(stderr,
+            "gc pause lengths: <10us %zu, <100us %zu, <1ms %zu, <10ms %zu, "
+            "<100ms %zu, longer %zu\n",
+            vm.gc_pause_histogram[0], vm.gc_pause_histogram[1],
+            vm.gc_pause_histogram[2], vm.gc_pause_histogram[3],
+            vm.gc_pause_histogram[4], vm.gc_pause_histogram[5]);
+    fprintf(stderr, "gc cpu time: %.3f ms\n",
+            (f64)vm.gc_cpu_time / 1000000.0);
+    fprintf(stderr, "gc collections: %zu major, %zu minor, %zu compactions\n",
+            vm.gc_major_count, vm.gc_minor_count, vm.gc_compaction_count);
+    fprintf(stderr, "gc bytes: %zu in use, %zu freed\n", vm.bytes_allocated,
+            vm.gc_bytes_freed);
+
+    size_t counts[OBJ_TYPE_COUNT];
+    heap_census(counts);
+    fprintf(stderr, "gc objects:");
+    for (size_t i = 0; i < OBJ_TYPE_COUNT; i++) {
+        fprintf(stderr, "%s %s %zu", i > 0 ? "," : "",
+                object_type_name((enum obj_type)i), counts[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+/**
+ * Parse the value of an option of the form <prefix><number>.
+ * @return Whether arg has that form.
+ */
+static bool parse_number(const char *arg, const char *prefix, u64 *number)
+{
+    const size_t length = strlen(prefix);
+    if (strncmp(arg, prefix, length) != 0)
+        return false;
+
+    const char *value = arg + length;
+    char *end;
+    *number = strtoull(value, &end, 10);
+    return end != value && *end == '\0';
+}
+
+/**
+ * Parse a size or factor, which may end in K, M or G to be multiplied by
+ * 1024, 1024^2 or 1024^3.
+ * @return Whether text is such a number.
+ */
+static bool parse_real(const char *text, f64 *number)
+{
+    char *end;
+    *number = strtod(text, &end);
+    if (end == text)
+        return false;
+
+    switch (*end) {
+    case 'K':
+        *number *= 1024.0;
+        end++;
+        break;
+    case 'M':
+        *number *= 1024.0 * 1024.0;
+        end++;
+        break;
+    case 'G':
+        *number *= 1024.0 * 1024.0 * 1024.0;
+        end++;
+        break;
+    default:
+        break;
+    }
+    return *end == '\0';
+}
+
+static bool gc_stats = false;
+
+struct gc_option {
+    const char *prefix;
+    const char *variable;
+    enum gc_setting setting;
+};
+
+static const struct gc_option gc_options[] = {
+    {"--gc-grow-factor=", "CLOX_GC_GROW_FACTOR", GC_GROW_FACTOR},
+    {"--gc-initial-heap=", "CLOX_GC_INITIAL_HEAP", GC_INITIAL_HEAP},
+    {"--gc-max-heap=", "CLOX_GC_MAX_HEAP", GC_MAX_HEAP},
+    {"--gc-min-interval=", "CLOX_GC_MIN_INTERVAL", GC_MIN_INTERVAL},
+};
+
+#define GC_OPTION_COUNT (sizeof(gc_options) / sizeof(gc_options[0]))
+
+// Settings from the environment are applied first, so that options override
+// them.
+static void read_environment(void)
+{
+    for (size_t i = 0; i < GC_OPTION_COUNT; i++) {
+        const char *text = getenv(gc_options[i].variable);
+        if (!text)
+            continue;
+
+        f64 value;
+        if (!parse_real(text, &value) ||
+            !gc_tune(gc_options[i].setting, value)) {
+            fprintf(stderr, "Invalid value for %s.\n",
+                    gc_options[i].variable);
+            exit(64);
+        }
+    }
+}
+
+static bool parse_option(const char *arg)
+{
+    u64 number;
+
+    for (size_t i = 0; i < GC_OPTION_COUNT; i++) {
+        const size_t length = strlen(gc_options[i].prefix);
+        f64 value;
+        if (strncmp(arg, gc_options[i].prefix, length) == 0)
+            return parse_real(arg + length, &value) &&
+                   gc_tune(gc_options[i].setting, value);
+    }
+
+    if (parse_number(arg, "--gc-pause-budget=", &number)) {
+        vm.gc_pause_budget = number * 1000;
+        return true;
+    }
+
+    if (parse_number(arg, "--gc-compact=", &number) && number <= 100) {
+        vm.gc_compact_threshold = (u32)number;
+        return true;
+    }
+
+#ifdef CONCURRENT_MARKING
+    if (strcmp(arg, "--gc-concurrent") == 0) {
+        vm.gc_concurrent = true;
+        return true;
+    }
+#endif
+
+#ifdef PARALLEL_MARKING
+    if (parse_number(arg, "--gc-threads=", &number) && number > 0) {
+        vm.gc_threads = (size_t)number;
+        return true;
+    }
+#endif
+
+    if (strcmp(arg, "--gc-stats") == 0) {
+        gc_stats = true;
+        return true;
+    }
+
+    return false;
+}
+
 i32 main(i32 argc, char *argv[])
 {
     vm_init();
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+    // Registered before print_gc_stats(), so that it runs after it, and
+    // also on the exits for errors.
+    atexit(vm_free);
+    read_environment();
+
+    const char *path = NULL;
+    for (i32 i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            if (!parse_option(argv[i]))
+                usage();
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+    if (gc_stats)
+        atexit(print_gc_stats);
+
+    if (path) {
+        run_file(path);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        repl();
     }
-    vm_free();
     return 0;
 }
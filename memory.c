@@ -1,7 +1,10 @@
 #include "memory.h"
 
 #include "compiler.h"
+#include "intern.h"
 #include "object.h"
+#include "shape.h"
+#include "slab.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -9,21 +12,55 @@
 #include "debug.h"
 #include <stdio.h>
 #endif
+#if defined(PARALLEL_MARKING) || defined(CONCURRENT_MARKING)
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#endif
+#ifdef PARALLEL_MARKING
+#include <unistd.h>
+#endif
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-#define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated between two steps of an incremental major collection.
+#define GC_STEP_SIZE (64 * 1024)
+// Objects traced or swept between two checks of the pause budget.
+#define GC_STEP_WORK 64
+#define NO_DEADLINE UINT64_MAX
+// Length of a sweep step if vm.gc_pause_budget does not say otherwise.
+#define GC_SWEEP_SLICE (1000 * 1000)
+// Smaller heaps are not worth compacting.
+#define GC_COMPACT_MIN_HEAP (1024 * 1024)
+#ifdef CONCURRENT_MARKING
+// Overwritten references logged before they are handed to the marking
+// thread, even if no allocation runs a step.
+#define SATB_LOG_FLUSH 1024
+#endif
+#ifdef PARALLEL_MARKING
+// Smaller heaps are marked faster than the other threads wake up.
+#define PARALLEL_MARK_MIN_HEAP (1024 * 1024)
+#define MARK_THREADS_MAX 64
+#define GRAY_DEQUE_INITIAL 256
+#endif
 
-void *reallocate(void *ptr, size_t old_size, size_t new_size)
+static void track_allocation(size_t old_size, size_t new_size)
 {
     vm.bytes_allocated += new_size - old_size;
     if (new_size > old_size) {
 #ifdef DEBUG_STRESS_GC
-        collect_garbage();
+        collect_garbage_step();
 #endif
         if (vm.bytes_allocated > vm.next_gc) {
-            collect_garbage();
+            collect_garbage_step();
         }
     }
+}
+
+void *reallocate(void *ptr, size_t old_size, size_t new_size)
+{
+    track_allocation(old_size, new_size);
     if (new_size == 0) {
         free(ptr);
         return NULL;
@@ -37,9 +74,310 @@ void *reallocate(void *ptr, size_t old_size, size_t new_size)
     return new_ptr;
 }
 
+// Worklists grow with realloc() directly, as they are filled in the middle
+// of a collection.
+static void stack_push(struct obj_stack *stack, struct obj *object)
+{
+    if (stack->capacity < stack->count + 1) {
+        stack->capacity = GROW_CAPACITY(stack->capacity);
+        stack->objects =
+            realloc(stack->objects, sizeof(struct obj *) * stack->capacity);
+
+        if (!stack->objects)
+            exit(1);
+    }
+
+    stack->objects[stack->count++] = object;
+}
+
+static void stack_free(struct obj_stack *stack)
+{
+    free(stack->objects);
+    stack->objects = NULL;
+    stack->count = 0;
+    stack->capacity = 0;
+}
+
+static u64 now_ns(void)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (u64)now.tv_sec * 1000000000 + (u64)now.tv_nsec;
+}
+
+// Marking threads account for their time as they go.
+static void add_gc_time(u64 time)
+{
+    __atomic_fetch_add(&vm.gc_cpu_time, time, __ATOMIC_RELAXED);
+}
+
+static void record_pause(u64 start)
+{
+    const u64 pause = now_ns() - start;
+    vm.gc_pause_count++;
+    vm.gc_total_pause += pause;
+    if (pause > vm.gc_max_pause)
+        vm.gc_max_pause = pause;
+    add_gc_time(pause);
+
+    size_t bucket = 0;
+    for (u64 limit = 10000; pause >= limit && bucket < GC_PAUSE_BUCKETS - 1;
+         limit *= 10) {
+        bucket++;
+    }
+    vm.gc_pause_histogram[bucket]++;
+}
+
+#ifdef PARALLEL_MARKING
+struct gray_buffer {
+    // Always a power of two.
+    i64 capacity;
+    struct gray_buffer *next;
+    _Atomic(struct obj *) objects[];
+};
+
+// Chase-Lev work-stealing deque. Its owner pushes and pops at the bottom,
+// the other workers steal from the top.
+struct gray_deque {
+    _Atomic(i64) top;
+    _Atomic(i64) bottom;
+    _Atomic(struct gray_buffer *) buffer;
+    // Outgrown buffers, which thieves may read from until marking ends.
+    struct gray_buffer *retired;
+};
+
+struct mark_worker {
+    // Keep the deques of different workers on different cache lines.
+    _Alignas(64) struct gray_deque deque;
+    pthread_t thread;
+    u32 seed;
+};
+
+static struct {
+    // Worker 0 is the thread running the program.
+    struct mark_worker *workers;
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    u64 round;
+    // Threads still marking in the current round.
+    size_t busy;
+    bool stop;
+    // Workers that ran out of gray objects and found nothing to steal.
+    atomic_size_t idle;
+} marker = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+// Set while the thread takes part in a parallel mark.
+static _Thread_local struct mark_worker *current_worker;
+
+static struct gray_buffer *gray_buffer_new(i64 capacity)
+{
+    struct gray_buffer *buffer =
+        malloc(sizeof(struct gray_buffer) +
+               sizeof(_Atomic(struct obj *)) * (size_t)capacity);
+    if (!buffer)
+        exit(1);
+
+    buffer->capacity = capacity;
+    buffer->next = NULL;
+    return buffer;
+}
+
+static _Atomic(struct obj *) *gray_buffer_slot(struct gray_buffer *buffer,
+                                               i64 index)
+{
+    return &buffer->objects[index & (buffer->capacity - 1)];
+}
+
+static void deque_push(struct gray_deque *deque, struct obj *object)
+{
+    const i64 bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    const i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    struct gray_buffer *buffer =
+        atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+
+    if (bottom - top > buffer->capacity - 1) {
+        struct gray_buffer *grown = gray_buffer_new(buffer->capacity * 2);
+        for (i64 i = top; i < bottom; i++) {
+            atomic_store_explicit(
+                gray_buffer_slot(grown, i),
+                atomic_load_explicit(gray_buffer_slot(buffer, i),
+                                     memory_order_relaxed),
+                memory_order_relaxed);
+        }
+        buffer->next = deque->retired;
+        deque->retired = buffer;
+        atomic_store_explicit(&deque->buffer, grown, memory_order_release);
+        buffer = grown;
+    }
+
+    atomic_store_explicit(gray_buffer_slot(buffer, bottom), object,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static struct obj *deque_pop(struct gray_deque *deque)
+{
+    const i64 bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    struct gray_buffer *buffer =
+        atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    i64 top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+        return NULL;
+    }
+
+    struct obj *object = atomic_load_explicit(
+        gray_buffer_slot(buffer, bottom), memory_order_relaxed);
+    if (top == bottom) {
+        // The last object may be stolen at the same time.
+        if (!atomic_compare_exchange_strong_explicit(
+                &deque->top, &top, top + 1, memory_order_seq_cst,
+                memory_order_relaxed))
+            object = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+    }
+    return object;
+}
+
+/**
+ * Take the object at the top of another worker's deque.
+ * @return The object, or NULL if the deque was empty or another thread took
+ *         the object first.
+ */
+static struct obj *deque_steal(struct gray_deque *deque)
+{
+    i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const i64 bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+
+    struct gray_buffer *buffer =
+        atomic_load_explicit(&deque->buffer, memory_order_acquire);
+    struct obj *object = atomic_load_explicit(gray_buffer_slot(buffer, top),
+                                              memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL;
+    return object;
+}
+
+static bool deque_is_empty(struct gray_deque *deque)
+{
+    return atomic_load_explicit(&deque->top, memory_order_relaxed) >=
+           atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+}
+#endif
+
+static size_t object_size(const struct obj *object);
+static void sweep_lazily(size_t size);
+
+static u64 *mark_word(const struct obj *object, u64 *bit)
+{
+    if (is_young(object)) {
+        const size_t index =
+            (size_t)((const u8 *)object - vm.nursery) / NURSERY_ALIGNMENT;
+        *bit = (u64)1 << (index % 64);
+        return &vm.nursery_marks[index / 64];
+    }
+    return slab_mark_word(object, object_size(object), bit);
+}
+
+// Whether other threads may be setting mark bits at the same time.
+static bool marks_shared(void)
+{
+#ifdef PARALLEL_MARKING
+    if (current_worker)
+        return true;
+#endif
+    return vm.gc_concurrent;
+}
+
+/**
+ * Set a mark bit.
+ * @return Whether it was clear before.
+ */
+static bool mark_word_set(u64 *word, u64 bit)
+{
+    // Only the first of the threads that reach an object at once traces it.
+    if (marks_shared())
+        return !(__atomic_load_n(word, __ATOMIC_RELAXED) & bit) &&
+               !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+
+    if (*word & bit)
+        return false;
+
+    *word |= bit;
+    return true;
+}
+
+/**
+ * Set the mark bit of the object.
+ * @return Whether it was clear before, in which case the caller has to trace
+ *         the object.
+ */
+static bool set_mark(struct obj *object)
+{
+    u64 bit;
+    u64 *word = mark_word(object, &bit);
+    return mark_word_set(word, bit);
+}
+
+bool object_is_marked(const struct obj *object)
+{
+    u64 bit;
+    const u64 *word = mark_word(object, &bit);
+    return *word & bit;
+}
+
+void nursery_mark(void *memory)
+{
+    set_mark(memory);
+}
+
+// Objects are allocated marked while a major collection is marking, as it
+// only looks for what was reachable when it started, and while it has yet to
+// sweep the memory they are allocated in.
+static struct obj *old_alloc(size_t size, bool marked)
+{
+    if (vm.gc_phase == GC_SWEEP)
+        sweep_lazily(size);
+
+    struct obj *object = slab_alloc(&vm.slabs, size);
+    if (marked ||
+        (vm.gc_phase == GC_SWEEP && slab_is_unswept(object, size))) {
+        u64 bit;
+        u64 *word = slab_mark_word(object, size, &bit);
+        mark_word_set(word, bit);
+    }
+    return object;
+}
+
+void *object_allocate(size_t size)
+{
+    track_allocation(0, size);
+    return old_alloc(size, vm.gc_phase == GC_MARK);
+}
+
 void object_mark(struct obj *object)
 {
-    if (!object || object->is_marked)
+    if (!object || !set_mark(object))
         return;
 
 #ifdef DEBUG_LOG_GC
@@ -48,18 +386,13 @@ void object_mark(struct obj *object)
     printf("\n");
 #endif
 
-    object->is_marked = true;
-
-    if (vm.gray_capacity < vm.gray_count + 1) {
-        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-        vm.gray_stack =
-            realloc(vm.gray_stack, sizeof(struct obj *) * vm.gray_capacity);
-
-        if (!vm.gray_stack)
-            exit(1);
+#ifdef PARALLEL_MARKING
+    if (current_worker) {
+        deque_push(&current_worker->deque, object);
+        return;
     }
-
-    vm.gray_stack[vm.gray_count++] = object;
+#endif
+    stack_push(&vm.gray_stack, object);
 }
 
 void value_mark(value_ty value)
@@ -76,6 +409,17 @@ void array_mark(const struct value_array *array)
     }
 }
 
+static void invoke_caches_mark(const struct chunk *chunk)
+{
+    for (size_t i = 0; i < chunk->invoke_cache_count; i++) {
+        const struct invoke_cache *cache = &chunk->invoke_caches[i];
+        for (u8 j = 0; j < cache->count; j++) {
+            object_mark((struct obj *)cache->entries[j].klass);
+            object_mark((struct obj *)cache->entries[j].method);
+        }
+    }
+}
+
 static void blacken_object(struct obj *object)
 {
 #ifdef DEBUG_LOG_GC
@@ -96,6 +440,9 @@ static void blacken_object(struct obj *object)
         const struct obj_class *klass = (struct obj_class *)object;
         object_mark((struct obj *)klass->name);
         table_mark(&klass->methods);
+        for (size_t i = 0; i < klass->vtable_count; i++) {
+            object_mark((struct obj *)FIELD_LOAD(klass->vtable[i].method));
+        }
         break;
     }
     case OBJ_CLOSURE: {
@@ -110,16 +457,26 @@ static void blacken_object(struct obj *object)
         const struct obj_function *function = (struct obj_function *)object;
         object_mark((struct obj *)function->name);
         array_mark(&function->chunk.constants);
+        invoke_caches_mark(&function->chunk);
         break;
     }
     case OBJ_INSTANCE: {
         const struct obj_instance *instance = (struct obj_instance *)object;
         object_mark((struct obj *)instance->klass);
-        table_mark(&instance->fields);
+        for (size_t i = 0; i < instance->shape->slot_count; i++) {
+            value_mark(FIELD_LOAD(instance->fields[i]));
+        }
+        break;
+    }
+    case OBJ_ROPE: {
+        const struct obj_rope *rope = (struct obj_rope *)object;
+        value_mark(FIELD_LOAD(rope->left));
+        value_mark(FIELD_LOAD(rope->right));
+        value_mark(FIELD_LOAD(rope->flat));
         break;
     }
     case OBJ_UPVALUE:
-        value_mark(((struct obj_upvalue *)object)->closed);
+        value_mark(FIELD_LOAD(((struct obj_upvalue *)object)->closed));
         break;
     case OBJ_NATIVE:
     case OBJ_STRING:
@@ -127,56 +484,364 @@ static void blacken_object(struct obj *object)
     }
 }
 
-void free_object(struct obj *object)
+#ifdef PARALLEL_MARKING
+static struct obj *steal_work(struct mark_worker *self)
 {
-#ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void *)object, object->type);
+    // Start at a random victim so the thieves spread out.
+    self->seed = self->seed * 1103515245 + 12345;
+    const size_t start = (self->seed >> 16) % marker.count;
+
+    for (size_t i = 0; i < marker.count; i++) {
+        struct mark_worker *victim =
+            &marker.workers[(start + i) % marker.count];
+        if (victim == self)
+            continue;
+
+        struct obj *object = deque_steal(&victim->deque);
+        if (object)
+            return object;
+    }
+    return NULL;
+}
+
+static bool any_work_left(void)
+{
+    for (size_t i = 0; i < marker.count; i++) {
+        if (!deque_is_empty(&marker.workers[i].deque))
+            return true;
+    }
+    return false;
+}
+
+// Blacken objects until every worker is out of them. A worker only counts
+// itself idle with an empty deque, so once all of them are, no gray object
+// is left anywhere.
+static void mark_worker_run(struct mark_worker *self)
+{
+    for (;;) {
+        struct obj *object = deque_pop(&self->deque);
+        if (!object)
+            object = steal_work(self);
+        if (object) {
+            blacken_object(object);
+            continue;
+        }
+
+        atomic_fetch_add(&marker.idle, 1);
+        for (;;) {
+            if (atomic_load(&marker.idle) == marker.count)
+                return;
+            if (any_work_left())
+                break;
+            sched_yield();
+        }
+        atomic_fetch_sub(&marker.idle, 1);
+    }
+}
+
+static void *mark_thread(void *arg)
+{
+    struct mark_worker *self = arg;
+    u64 round = 0;
+    current_worker = self;
+
+    pthread_mutex_lock(&marker.lock);
+    for (;;) {
+        while (marker.round == round && !marker.stop)
+            pthread_cond_wait(&marker.wake, &marker.lock);
+        if (marker.stop)
+            break;
+
+        round = marker.round;
+        pthread_mutex_unlock(&marker.lock);
+        const u64 start = now_ns();
+        mark_worker_run(self);
+        add_gc_time(now_ns() - start);
+        pthread_mutex_lock(&marker.lock);
+
+        if (--marker.busy == 0)
+            pthread_cond_signal(&marker.done);
+    }
+    pthread_mutex_unlock(&marker.lock);
+    return NULL;
+}
+
+static void marker_start(void)
+{
+    size_t count = vm.gc_threads;
+    if (count == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (count > MARK_THREADS_MAX)
+        count = MARK_THREADS_MAX;
+
+    marker.workers =
+        aligned_alloc(_Alignof(struct mark_worker),
+                      sizeof(struct mark_worker) * count);
+    if (!marker.workers)
+        exit(1);
+
+    for (size_t i = 0; i < count; i++) {
+        struct mark_worker *worker = &marker.workers[i];
+        atomic_init(&worker->deque.top, 0);
+        atomic_init(&worker->deque.bottom, 0);
+        atomic_init(&worker->deque.buffer,
+                    gray_buffer_new(GRAY_DEQUE_INITIAL));
+        worker->deque.retired = NULL;
+        worker->seed = (u32)i + 1;
+    }
+
+    // Mark with fewer threads if the system refuses to start more.
+    marker.count = 1;
+    while (marker.count < count &&
+           pthread_create(&marker.workers[marker.count].thread, NULL,
+                          mark_thread, &marker.workers[marker.count]) == 0)
+        marker.count++;
+}
+
+static void free_gray_buffers(struct gray_buffer *buffer)
+{
+    while (buffer) {
+        struct gray_buffer *next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+}
+
+static void marker_stop(void)
+{
+    if (!marker.workers)
+        return;
+
+    pthread_mutex_lock(&marker.lock);
+    marker.stop = true;
+    pthread_cond_broadcast(&marker.wake);
+    pthread_mutex_unlock(&marker.lock);
+
+    for (size_t i = 0; i < marker.count; i++) {
+        if (i > 0)
+            pthread_join(marker.workers[i].thread, NULL);
+        free_gray_buffers(marker.workers[i].deque.buffer);
+        free_gray_buffers(marker.workers[i].deque.retired);
+    }
+    free(marker.workers);
+    marker.workers = NULL;
+}
+
+static bool should_mark_in_parallel(void)
+{
+    if (vm.bytes_allocated < PARALLEL_MARK_MIN_HEAP)
+        return false;
+    if (!marker.workers)
+        marker_start();
+    return marker.count > 1;
+}
+
+// Deal the gray objects out to the workers and trace from them on every
+// thread until the heap is fully marked.
+static void trace_in_parallel(void)
+{
+    for (size_t i = 0; i < vm.gray_stack.count; i++) {
+        deque_push(&marker.workers[i % marker.count].deque,
+                   vm.gray_stack.objects[i]);
+    }
+    vm.gray_stack.count = 0;
+
+    atomic_store(&marker.idle, 0);
+    pthread_mutex_lock(&marker.lock);
+    marker.round++;
+    marker.busy = marker.count - 1;
+    pthread_cond_broadcast(&marker.wake);
+    pthread_mutex_unlock(&marker.lock);
+
+    current_worker = &marker.workers[0];
+    mark_worker_run(current_worker);
+    current_worker = NULL;
+
+    pthread_mutex_lock(&marker.lock);
+    while (marker.busy > 0)
+        pthread_cond_wait(&marker.done, &marker.lock);
+    pthread_mutex_unlock(&marker.lock);
+
+    for (size_t i = 0; i < marker.count; i++) {
+        free_gray_buffers(marker.workers[i].deque.retired);
+        marker.workers[i].deque.retired = NULL;
+    }
+}
 #endif
-    switch (object->type) {
-    case OBJ_STRING: {
-        const struct obj_string *string = (const struct obj_string *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(struct obj_string, object);
-        break;
+
+#ifdef CONCURRENT_MARKING
+static struct {
+    pthread_t thread;
+    bool started;
+    bool stop;
+    // Set from the start of a concurrent major collection to its remark.
+    bool marking;
+    // Guards the gray stack and every object the marking thread traces.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // Program threads waiting for the lock, which the marking thread lets
+    // go first.
+    atomic_uint waiting;
+} collector = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static void *collector_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&collector.lock);
+    while (!collector.stop) {
+        if (!collector.marking || vm.gray_stack.count == 0) {
+            pthread_cond_wait(&collector.wake, &collector.lock);
+            continue;
+        }
+
+        const u64 start = now_ns();
+        for (size_t i = 0; i < GC_STEP_WORK && vm.gray_stack.count > 0; i++) {
+            blacken_object(vm.gray_stack.objects[--vm.gray_stack.count]);
+        }
+        add_gc_time(now_ns() - start);
+
+        pthread_mutex_unlock(&collector.lock);
+        while (atomic_load(&collector.waiting) > 0)
+            sched_yield();
+        pthread_mutex_lock(&collector.lock);
     }
-    case OBJ_FUNCTION: {
-        struct obj_function *fn = (struct obj_function *)object;
-        chunk_free(&fn->chunk);
-        FREE(struct obj_function, object);
-        break;
+    pthread_mutex_unlock(&collector.lock);
+    return NULL;
+}
+
+static void collector_stop(void)
+{
+    if (!collector.started)
+        return;
+
+    pthread_mutex_lock(&collector.lock);
+    collector.stop = true;
+    pthread_cond_signal(&collector.wake);
+    pthread_mutex_unlock(&collector.lock);
+
+    pthread_join(collector.thread, NULL);
+    collector.started = false;
+}
+
+void marker_pause(void)
+{
+    atomic_fetch_add(&collector.waiting, 1);
+    pthread_mutex_lock(&collector.lock);
+    atomic_fetch_sub(&collector.waiting, 1);
+    vm.marker_paused = true;
+}
+
+void marker_resume(void)
+{
+    vm.marker_paused = false;
+    pthread_mutex_unlock(&collector.lock);
+}
+#endif
+
+static void flush_satb_log(void)
+{
+    for (size_t i = 0; i < vm.satb_log.count; i++) {
+        object_mark(vm.satb_log.objects[i]);
     }
-    case OBJ_NATIVE: {
-        FREE(struct obj_native, object);
-        break;
+    vm.satb_log.count = 0;
+}
+
+void object_shade(struct obj *object)
+{
+#ifdef CONCURRENT_MARKING
+    // The gray stack belongs to the marking thread, so the object waits in
+    // the log until the program next holds the lock.
+    if (vm.gc_concurrent) {
+        stack_push(&vm.satb_log, object);
+        if (vm.satb_log.count >= SATB_LOG_FLUSH && !vm.marker_paused) {
+            marker_pause();
+            flush_satb_log();
+            pthread_cond_signal(&collector.wake);
+            marker_resume();
+        }
+        return;
     }
+#endif
+    object_mark(object);
+}
+
+static size_t object_size(const struct obj *object)
+{
+    switch (object->type) {
+    case OBJ_BOUND_METHOD:
+        return sizeof(struct obj_bound_method);
+    case OBJ_CLASS:
+        return sizeof(struct obj_class);
+    case OBJ_CLOSURE:
+        return sizeof(struct obj_closure);
+    case OBJ_FUNCTION:
+        return sizeof(struct obj_function);
+    case OBJ_INSTANCE:
+        return instance_size(
+            ((const struct obj_instance *)object)->inline_capacity);
+    case OBJ_NATIVE:
+        return sizeof(struct obj_native);
+    case OBJ_ROPE:
+        return sizeof(struct obj_rope);
+    case OBJ_STRING:
+        return string_size(((const struct obj_string *)object)->length);
+    case OBJ_UPVALUE:
+        return sizeof(struct obj_upvalue);
+    }
+    return 0;
+}
+
+// Free the memory owned by the object, but not the object itself.
+static void release_object(struct obj *object)
+{
+    switch (object->type) {
+    case OBJ_FUNCTION:
+        chunk_free(&((struct obj_function *)object)->chunk);
+        break;
     case OBJ_CLOSURE: {
         const struct obj_closure *closure = (struct obj_closure *)object;
         FREE_ARRAY(struct obj_upvalue *, closure->upvalues,
                    (u64)closure->upvalue_count);
-        FREE(struct obj_closure, object);
         break;
     }
-    case OBJ_UPVALUE:
-        FREE(struct obj_upvalue, object);
-        break;
     case OBJ_CLASS: {
         struct obj_class *klass = (struct obj_class *)object;
         table_free(&klass->methods);
-        FREE(struct obj_class, object);
+        FREE_ARRAY(struct method_slot, klass->vtable, klass->vtable_capacity);
         break;
     }
     case OBJ_INSTANCE: {
-        struct obj_instance *instance = (struct obj_instance *)object;
-        table_free(&instance->fields);
-        FREE(struct obj_instance, object);
+        const struct obj_instance *instance = (struct obj_instance *)object;
+        if (instance->fields != instance->inline_fields)
+            FREE_ARRAY(value_ty, instance->fields, instance->field_capacity);
         break;
     }
     case OBJ_BOUND_METHOD:
-        FREE(struct obj_bound_method, object);
+    case OBJ_NATIVE:
+    case OBJ_ROPE:
+    case OBJ_STRING:
+    case OBJ_UPVALUE:
         break;
     }
 }
 
+void free_object(struct obj *object)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void *)object, object->type);
+#endif
+    release_object(object);
+    const size_t size = object_size(object);
+    vm.bytes_allocated -= size;
+    slab_release(&vm.slabs, object, size);
+}
+
 static void mark_roots(void)
 {
     for (const value_ty *slot = vm.stack; slot < vm.stack_top; slot++) {
@@ -192,73 +857,737 @@ static void mark_roots(void)
         object_mark((struct obj *)upvalue);
     }
 
-    table_mark(&vm.globals);
+    table_mark(&vm.global_slots);
+    array_mark(&vm.global_names);
+    array_mark(&vm.globals);
+    shapes_mark();
     mark_compiler_roots();
     object_mark((struct obj *)vm.init_string);
 }
 
-static void trace_references(void)
+#define NURSERY_FOR_EACH(object)                                    \
+    for (struct obj *object = (struct obj *)vm.nursery;             \
+         (u8 *)object < vm.nursery_top;                             \
+         object = (struct obj *)((u8 *)object +                     \
+                                 NURSERY_ROUND(object_size(object))))
+
+static bool out_of_time(u64 deadline)
 {
-    while (vm.gray_count > 0) {
-        struct obj *object = vm.gray_stack[--vm.gray_count];
-        blacken_object(object);
+    if (deadline == NO_DEADLINE)
+        return false;
+#ifdef DEBUG_STRESS_GC
+    // Interleave as much work as possible with the program.
+    return true;
+#else
+    return now_ns() >= deadline;
+#endif
+}
+
+static void begin_cycle(void)
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+    mark_roots();
+    vm.gc_phase = GC_MARK;
+}
+
+/**
+ * Blacken gray objects until none are left or the deadline has passed.
+ * @return Whether the gray stack is empty.
+ */
+static bool trace_references(u64 deadline)
+{
+#ifdef PARALLEL_MARKING
+    if (deadline == NO_DEADLINE && should_mark_in_parallel()) {
+        trace_in_parallel();
+        return true;
+    }
+#endif
+    while (vm.gray_stack.count > 0) {
+        for (size_t i = 0; i < GC_STEP_WORK && vm.gray_stack.count > 0; i++) {
+            blacken_object(vm.gray_stack.objects[--vm.gray_stack.count]);
+        }
+
+        if (out_of_time(deadline))
+            break;
+    }
+    return vm.gray_stack.count == 0;
+}
+
+// Drop remembered objects that are about to be swept.
+static void remembered_remove_unreachable(void)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < vm.remembered.count; i++) {
+        struct obj *object = vm.remembered.objects[i];
+        if (object_is_marked(object))
+            vm.remembered.objects[count++] = object;
+    }
+    vm.remembered.count = count;
+}
+
+// Tracing from the roots marked when the collection began and from every
+// reference overwritten since reaches all that was reachable then. Objects
+// allocated since are already marked, so nothing needs to be rescanned.
+static void finish_marking(void)
+{
+    flush_satb_log();
+    trace_references(NO_DEADLINE);
+    intern_set_remove_unreachable(&vm.strings);
+    remembered_remove_unreachable();
+
+    // Young objects are left to the next minor collection, which frees the
+    // ones that were not marked here.
+    memset(vm.nursery_marks, 0, NURSERY_MARKS_SIZE);
+
+    // Pages and large blocks allocated from here on are not swept.
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        struct slab_class *class = &vm.slabs.classes[i];
+        for (struct slab_page *page = class->pages; page; page = page->next) {
+            page->unswept = true;
+        }
+        class->sweep = class->pages;
+    }
+    for (struct slab_large *large = vm.slabs.large; large;
+         large = large->next) {
+        large->unswept = true;
+    }
+    vm.sweep_class = 0;
+    vm.sweep_large = vm.slabs.large;
+    vm.gc_phase = GC_SWEEP;
+#ifdef CONCURRENT_MARKING
+    collector.marking = false;
+#endif
+}
+
+static void reclaim_object(struct obj *object)
+{
+    vm.gc_bytes_freed += object_size(object);
+    free_object(object);
+}
+
+// Free the unmarked objects of the page a word of bits at a time, and clear
+// the marks of the others for the next collection.
+static void sweep_page(struct slab_page *page)
+{
+    for (size_t i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        u64 dead = page->live[i] & ~page->marks[i];
+        while (dead) {
+            const size_t index = i * 64 + (size_t)__builtin_ctzll(dead);
+            dead &= dead - 1;
+            reclaim_object(
+                (struct obj *)((u8 *)page + index * SLAB_GRANULE));
+        }
+        page->marks[i] = 0;
+    }
+    page->unswept = false;
+}
+
+static void sweep_large(struct slab_large *large)
+{
+    large->unswept = false;
+    if (large->marks)
+        large->marks = 0;
+    else
+        reclaim_object((struct obj *)(large + 1));
+}
+
+// Whether more of the slab pages is free than vm.gc_compact_threshold
+// allows.
+static bool heap_fragmented(void)
+{
+    if (vm.gc_compact_threshold == 0)
+        return false;
+
+    size_t capacity = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        const struct slab_class *class = &vm.slabs.classes[i];
+        const size_t slot_size = (i + 1) * SLAB_GRANULE;
+        capacity += class->page_count * slab_page_slots(slot_size) * slot_size;
+        used += class->live * slot_size;
+    }
+    return capacity >= GC_COMPACT_MIN_HEAP &&
+           (capacity - used) * 100 > capacity * vm.gc_compact_threshold;
+}
+
+// Heap size that starts the next major collection, once one has ended.
+static size_t next_threshold(void)
+{
+    size_t next = (size_t)((f64)vm.bytes_allocated * vm.gc_grow_factor);
+    if (vm.gc_max_heap > 0 && next > vm.gc_max_heap) {
+        // A heap that outgrew the limit is still left to grow a little
+        // between collections, rather than collected continuously.
+        next = vm.bytes_allocated + GC_STEP_SIZE;
+        if (next < vm.gc_max_heap)
+            next = vm.gc_max_heap;
     }
+    if (next < vm.bytes_allocated + vm.gc_min_interval)
+        next = vm.bytes_allocated + vm.gc_min_interval;
+    return next;
 }
 
-static void sweep(void)
+bool gc_tune(enum gc_setting setting, f64 value)
 {
-    struct obj *previous = NULL;
-    struct obj *object = vm.objects;
+    // Also rejects NaN.
+    if (!(value >= 0 && value < (f64)(SIZE_MAX / 2)))
+        return false;
+
+    switch (setting) {
+    case GC_GROW_FACTOR:
+        if (value < 1)
+            return false;
+        vm.gc_grow_factor = value;
+        break;
+    case GC_INITIAL_HEAP:
+        if (value < 1)
+            return false;
+        vm.gc_initial_heap = (size_t)value;
+        if (vm.gc_major_count == 0 && vm.gc_phase == GC_IDLE)
+            vm.next_gc = vm.gc_initial_heap;
+        break;
+    case GC_MAX_HEAP:
+        vm.gc_max_heap = (size_t)value;
+        break;
+    case GC_MIN_INTERVAL:
+        vm.gc_min_interval = (size_t)value;
+        break;
+    }
+    return true;
+}
+
+// Whether every page and large block has been swept, which ends the
+// collection.
+static bool sweep_done(void)
+{
+    while (vm.sweep_class < SLAB_CLASS_COUNT &&
+           !vm.slabs.classes[vm.sweep_class].sweep)
+        vm.sweep_class++;
+    if (vm.sweep_class < SLAB_CLASS_COUNT || vm.sweep_large)
+        return false;
+
+    vm.gc_phase = GC_IDLE;
+    vm.gc_major_count++;
+    vm.next_gc = next_threshold();
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   %zu bytes in use, next at %zu\n", vm.bytes_allocated,
+           vm.next_gc);
+#endif
+    // Objects only move at safepoints, so compaction waits for the next
+    // minor collection.
+    if (heap_fragmented()) {
+        vm.compact_pending = true;
+        vm.nursery_full = true;
+    }
+    return true;
+}
 
-    while (object) {
-        if (object->is_marked) {
-            // Marked objects aren't freed but they're unmarked
-            // for the next GC cycle.
-            object->is_marked = false;
-            previous = object;
-            object = object->next;
+static void sweep(u64 deadline)
+{
+    while (!sweep_done()) {
+        if (vm.sweep_class < SLAB_CLASS_COUNT) {
+            struct slab_class *class = &vm.slabs.classes[vm.sweep_class];
+            struct slab_page *page = class->sweep;
+            class->sweep = page->next;
+            sweep_page(page);
         } else {
-            // Object is unreachable so unlink and free it.
-            struct obj *unreached = object;
-            object = object->next;
-
-            if (previous) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
+            for (size_t i = 0; i < GC_STEP_WORK && vm.sweep_large; i++) {
+                struct slab_large *large = vm.sweep_large;
+                vm.sweep_large = large->next;
+                sweep_large(large);
             }
-
-            free_object(unreached);
         }
+
+        if (out_of_time(deadline))
+            break;
     }
 }
 
+// Sweep pages of the size class until one of their slots is free, so that
+// the class takes a new page only when the garbage in its pages is gone.
+static void sweep_lazily(size_t size)
+{
+    if (size > SLAB_MAX_SIZE)
+        return;
+
+    struct slab_class *class = slab_class_of(&vm.slabs, size);
+    while (!class->free && class->sweep) {
+        struct slab_page *page = class->sweep;
+        class->sweep = page->next;
+        sweep_page(page);
+    }
+}
+
+// Mark the whole heap in one pause, finishing the marking in progress if
+// there is one.
+static void mark_heap(void)
+{
+    heap_lock();
+    if (vm.gc_phase == GC_IDLE)
+        begin_cycle();
+    if (vm.gc_phase == GC_MARK)
+        finish_marking();
+    heap_unlock();
+}
+
 void collect_garbage(void)
 {
+    const u64 start = now_ns();
+
+    mark_heap();
+    sweep(NO_DEADLINE);
+
+    record_pause(start);
+}
+
+#ifdef CONCURRENT_MARKING
+static void concurrent_step(void)
+{
+    // The program is in the middle of changing an object.
+    if (vm.heap_lock_depth > 0)
+        return;
+
+    if (!collector.started) {
+        if (pthread_create(&collector.thread, NULL, collector_thread, NULL)) {
+            vm.gc_concurrent = false;
+            collect_garbage_step();
+            return;
+        }
+        collector.started = true;
+    }
+
+    const u64 start = now_ns();
+
+    marker_pause();
+    if (vm.gc_phase == GC_IDLE) {
+        begin_cycle();
+        collector.marking = true;
+    } else {
+        flush_satb_log();
+        // The marking thread has caught up with the program.
+        if (vm.gray_stack.count == 0)
+            finish_marking();
+    }
+    pthread_cond_signal(&collector.wake);
+    marker_resume();
+
+    if (vm.gc_phase != GC_IDLE)
+        vm.next_gc = vm.bytes_allocated + GC_STEP_SIZE;
+
+    record_pause(start);
+}
+#endif
+
+void collect_garbage_step(void)
+{
+#ifdef CONCURRENT_MARKING
+    if (vm.gc_concurrent && vm.gc_phase != GC_SWEEP) {
+        concurrent_step();
+        return;
+    }
+#endif
+    const u64 start = now_ns();
+
+    if (vm.gc_phase == GC_SWEEP) {
+        // Allocation only sweeps the size classes it allocates from, the
+        // others are swept here.
+        const u64 slice =
+            vm.gc_pause_budget > 0 ? vm.gc_pause_budget : GC_SWEEP_SLICE;
+        sweep(start + slice);
+    } else if (vm.gc_pause_budget == 0) {
+        mark_heap();
+    } else if (vm.gc_phase == GC_IDLE) {
+        begin_cycle();
+    } else if (trace_references(start + vm.gc_pause_budget)) {
+        finish_marking();
+    }
+
+    if (vm.gc_phase != GC_IDLE)
+        vm.next_gc = vm.bytes_allocated + GC_STEP_SIZE;
+
+    record_pause(start);
+}
+
+#define PROMOTE(pointer) \
+    ((pointer) = (void *)object_promote((struct obj *)(pointer)))
+
+// Copy the object and leave the address of the copy behind in next.
+static void move_object(struct obj *object, struct obj *copy, size_t size)
+{
+    memcpy(copy, object, size);
+    object->next = copy;
+
+    if (object->type == OBJ_UPVALUE) {
+        struct obj_upvalue *upvalue = (struct obj_upvalue *)copy;
+        if (upvalue->location == &((struct obj_upvalue *)object)->closed)
+            upvalue->location = &upvalue->closed;
+    } else if (object->type == OBJ_INSTANCE) {
+        struct obj_instance *instance = (struct obj_instance *)copy;
+        if (instance->fields ==
+            ((struct obj_instance *)object)->inline_fields)
+            instance->fields = instance->inline_fields;
+    }
+}
+
+struct obj *object_promote(struct obj *object)
+{
+    if (!is_young(object)) {
+        // Old objects are only moved by compaction.
+        if (vm.compacting && object && object->next)
+            return object->next;
+        return object;
+    }
+    if (object->next)
+        return object->next;
+
+    // The copy bypasses object_allocate(), as a collection must not start in
+    // the middle of this one.
+    const size_t size = object_size(object);
+    struct obj *copy = old_alloc(size, object_is_marked(object));
+    move_object(object, copy, size);
+    vm.bytes_allocated += size;
+
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
+    printf("%p promote to %p\n", (void *)object, (void *)copy);
 #endif
-    mark_roots();
-    trace_references();
-    table_remove_unreachable(&vm.strings);
-    sweep();
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+
+    stack_push(&vm.promoted, copy);
+    return copy;
+}
+
+void value_promote(value_ty *value)
+{
+    if (IS_OBJ(*value))
+        *value = OBJ_VAL(object_promote(AS_OBJ(*value)));
+}
+
+static void array_promote(const struct value_array *array)
+{
+    for (size_t i = 0; i < array->count; i++) {
+        value_promote(&array->values[i]);
+    }
+}
+
+static void promote_children(struct obj *object)
+{
+    switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+        struct obj_bound_method *bound = (struct obj_bound_method *)object;
+        value_promote(&bound->receiver);
+        PROMOTE(bound->method);
+        break;
+    }
+    case OBJ_CLASS: {
+        struct obj_class *klass = (struct obj_class *)object;
+        PROMOTE(klass->name);
+        value_promote(&klass->initializer);
+        table_promote(&klass->methods);
+        for (size_t i = 0; i < klass->vtable_count; i++) {
+            PROMOTE(klass->vtable[i].name);
+            PROMOTE(klass->vtable[i].method);
+        }
+        break;
+    }
+    case OBJ_CLOSURE: {
+        struct obj_closure *closure = (struct obj_closure *)object;
+        PROMOTE(closure->fn);
+        for (i32 i = 0; i < closure->upvalue_count; i++) {
+            PROMOTE(closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_FUNCTION: {
+        struct obj_function *fn = (struct obj_function *)object;
+        PROMOTE(fn->name);
+        array_promote(&fn->chunk.constants);
+        for (size_t i = 0; i < fn->chunk.invoke_cache_count; i++) {
+            struct invoke_cache *cache = &fn->chunk.invoke_caches[i];
+            for (u8 j = 0; j < cache->count; j++) {
+                PROMOTE(cache->entries[j].klass);
+                PROMOTE(cache->entries[j].method);
+            }
+        }
+        break;
+    }
+    case OBJ_INSTANCE: {
+        struct obj_instance *instance = (struct obj_instance *)object;
+        PROMOTE(instance->klass);
+        for (size_t i = 0; i < instance->shape->slot_count; i++) {
+            value_promote(&instance->fields[i]);
+        }
+        break;
+    }
+    case OBJ_ROPE: {
+        struct obj_rope *rope = (struct obj_rope *)object;
+        value_promote(&rope->left);
+        value_promote(&rope->right);
+        value_promote(&rope->flat);
+        break;
+    }
+    case OBJ_UPVALUE:
+        value_promote(&((struct obj_upvalue *)object)->closed);
+        break;
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    }
+}
+
+// Blacken the young gray objects of a major collection. One that dies in
+// this minor collection may be all that still leads to an object that was
+// reachable when the major collection started, and has since been stored
+// where no barrier sees it, such as a stack slot or an object allocated
+// marked. What is left gray is old, so it does not move, and promoted copies
+// keep their mark.
+static void blacken_young(void)
+{
+    flush_satb_log();
+    size_t i = 0;
+    while (i < vm.gray_stack.count) {
+        struct obj *object = vm.gray_stack.objects[i];
+        if (!is_young(object)) {
+            i++;
+            continue;
+        }
+        vm.gray_stack.objects[i] =
+            vm.gray_stack.objects[--vm.gray_stack.count];
+        blacken_object(object);
+    }
+}
+
+static void promote_roots(void)
+{
+    for (value_ty *slot = vm.stack; slot < vm.stack_top; slot++) {
+        value_promote(slot);
+    }
+
+    for (size_t i = 0; i < vm.frame_count; i++) {
+        PROMOTE(vm.frames[i].closure);
+    }
+
+    for (struct obj_upvalue **upvalue = &vm.open_upvalues; *upvalue;
+         upvalue = &(*upvalue)->next) {
+        PROMOTE(*upvalue);
+    }
+
+    table_promote(&vm.global_slots);
+    array_promote(&vm.global_names);
+    array_promote(&vm.globals);
+    shapes_promote();
+    PROMOTE(vm.init_string);
+}
+
+// Call visit on every object allocated in the page.
+static void page_for_each(struct slab_page *page, void (*visit)(struct obj *))
+{
+    for (size_t i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        u64 live = page->live[i];
+        while (live) {
+            const size_t index = i * 64 + (size_t)__builtin_ctzll(live);
+            live &= live - 1;
+            visit((struct obj *)((u8 *)page + index * SLAB_GRANULE));
+        }
+    }
+}
+
+static void evacuate_object(struct obj *object)
+{
+    const size_t size = object_size(object);
+    move_object(object, slab_alloc(&vm.slabs, size), size);
+
+    // vm.strings holds its strings weakly, so it is not updated with the other
+    // references.
+    if (object->type == OBJ_STRING)
+        intern_set_replace(&vm.strings, (struct obj_string *)object,
+                           (struct obj_string *)object->next);
+}
+
+// Move the objects of the emptiest pages of each size class into the free
+// slots of the others, and give the pages that were emptied back to the
+// system. Right after a minor collection, the nursery is empty and the only
+// references left to update are those of the roots and the old generation.
+static void compact_heap(void)
+{
+    const u64 start = now_ns();
 #ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+    printf("-- compact begin\n");
+#endif
+    struct slab_page *evacuated = NULL;
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        struct slab_page *page = slab_evacuate(&vm.slabs.classes[i]);
+        while (page) {
+            struct slab_page *next = page->next;
+            page_for_each(page, evacuate_object);
+            page->next = evacuated;
+            evacuated = page;
+            page = next;
+        }
+    }
+    if (!evacuated)
+        return;
+
+    vm.compacting = true;
+    promote_roots();
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        for (struct slab_page *page = vm.slabs.classes[i].pages; page;
+             page = page->next) {
+            page_for_each(page, promote_children);
+        }
+    }
+    for (struct slab_large *large = vm.slabs.large; large;
+         large = large->next) {
+        promote_children((struct obj *)(large + 1));
+    }
+    vm.compacting = false;
+
+    slab_pages_release(evacuated);
+    vm.gc_compaction_count++;
+#ifdef DEBUG_LOG_GC
+    printf("-- compact end\n");
 #endif
+    record_pause(start);
+}
+
+void collect_nursery(void)
+{
+    const u64 start = now_ns();
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    const size_t before = vm.bytes_allocated;
+#endif
+    heap_lock();
+    if (vm.gc_phase == GC_MARK)
+        blacken_young();
+    promote_roots();
+
+    for (size_t i = 0; i < vm.remembered.count; i++) {
+        vm.remembered.objects[i]->is_remembered = false;
+        promote_children(vm.remembered.objects[i]);
+    }
+    vm.remembered.count = 0;
+
+    while (vm.promoted.count > 0) {
+        promote_children(vm.promoted.objects[--vm.promoted.count]);
+    }
+
+    // Everything left behind is garbage. vm.strings holds its strings weakly,
+    // so it is pointed at the new copies or loses the dead strings.
+    NURSERY_FOR_EACH(object)
+    {
+        if (object->next) {
+            if (object->type == OBJ_STRING)
+                intern_set_replace(&vm.strings, (struct obj_string *)object,
+                                   (struct obj_string *)object->next);
+        } else {
+            if (object->type == OBJ_STRING)
+                intern_set_delete(&vm.strings, (struct obj_string *)object);
+            vm.gc_bytes_freed += object_size(object);
+            release_object(object);
+        }
+    }
+
+    vm.nursery_top = vm.nursery;
+    vm.nursery_full = false;
+    memset(vm.nursery_marks, 0, NURSERY_MARKS_SIZE);
+    heap_unlock();
+    vm.gc_minor_count++;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu bytes\n", vm.bytes_allocated - before);
+#endif
+    record_pause(start);
+
+    if (vm.compact_pending) {
+        vm.compact_pending = false;
+        if (vm.gc_phase == GC_IDLE)
+            compact_heap();
+    }
+
+    if (vm.bytes_allocated > vm.next_gc)
+        collect_garbage_step();
+}
+
+void heap_census(size_t counts[OBJ_TYPE_COUNT])
+{
+    memset(counts, 0, sizeof(size_t) * OBJ_TYPE_COUNT);
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        for (const struct slab_page *page = vm.slabs.classes[i].pages; page;
+             page = page->next) {
+            for (size_t j = 0; j < SLAB_BITMAP_WORDS; j++) {
+                u64 live = page->live[j];
+                while (live) {
+                    const size_t index =
+                        j * 64 + (size_t)__builtin_ctzll(live);
+                    live &= live - 1;
+                    const struct obj *object =
+                        (const struct obj *)((const u8 *)page +
+                                             index * SLAB_GRANULE);
+                    counts[object->type]++;
+                }
+            }
+        }
+    }
+    for (const struct slab_large *large = vm.slabs.large; large;
+         large = large->next) {
+        counts[((const struct obj *)(large + 1))->type]++;
+    }
+    NURSERY_FOR_EACH(object)
+    {
+        counts[object->type]++;
+    }
+}
+
+void nursery_init(void)
+{
+    vm.nursery = malloc(NURSERY_SIZE);
+    vm.nursery_marks = calloc(1, NURSERY_MARKS_SIZE);
+    if (!vm.nursery || !vm.nursery_marks)
+        exit(1);
+
+    vm.nursery_top = vm.nursery;
+    vm.nursery_end = vm.nursery + NURSERY_SIZE;
+    vm.nursery_full = false;
+}
+
+void remember_object(struct obj *object)
+{
+    object->is_remembered = true;
+    stack_push(&vm.remembered, object);
 }
 
 void free_objects(void)
 {
-    struct obj *object = vm.objects;
-    while (object) {
-        struct obj *next = object->next;
-        free_object(object);
-        object = next;
+#ifdef CONCURRENT_MARKING
+    collector_stop();
+#endif
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        struct slab_class *class = &vm.slabs.classes[i];
+        for (struct slab_page *page = class->pages; page; page = page->next) {
+            memset(page->marks, 0, sizeof(page->marks));
+            sweep_page(page);
+        }
+    }
+    while (vm.slabs.large) {
+        free_object((struct obj *)(vm.slabs.large + 1));
     }
 
-    free(vm.gray_stack);
+    NURSERY_FOR_EACH(young)
+    {
+        if (!young->next)
+            release_object(young);
+    }
+
+    free(vm.nursery);
+    free(vm.nursery_marks);
+#ifdef PARALLEL_MARKING
+    marker_stop();
+#endif
+    stack_free(&vm.remembered);
+    stack_free(&vm.promoted);
+    stack_free(&vm.gray_stack);
+    stack_free(&vm.satb_log);
+    slab_heap_free(&vm.slabs);
 }
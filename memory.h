@@ -2,7 +2,9 @@
 #define CLOX__MEMORY_H_
 
 #include "common.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
     (type *)reallocate(NULL, 0, sizeof(type) * (count))
@@ -18,10 +20,201 @@
 #define FREE_ARRAY(type, pointer, old_count) \
     reallocate(pointer, sizeof(type) * (old_count), 0)
 
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_ALIGNMENT 8
+#define NURSERY_ROUND(size) \
+    (((size) + NURSERY_ALIGNMENT - 1) & ~(size_t)(NURSERY_ALIGNMENT - 1))
+#define NURSERY_MARKS_SIZE (NURSERY_SIZE / NURSERY_ALIGNMENT / 8)
+// Larger objects, such as long strings, are allocated in the old generation
+// rather than copied out of the nursery.
+#define NURSERY_MAX_OBJECT (16 * 1024)
+
 void *reallocate(void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * Allocate an object of the old generation from the slab for its size,
+ * accounted for like reallocate() does. The memory goes back to the slab
+ * when the object is swept.
+ */
+void *object_allocate(size_t size);
 void object_mark(struct obj *object);
 void value_mark(value_ty value);
+bool object_is_marked(const struct obj *object);
+/**
+ * Run a major collection to completion, finishing the one in progress if
+ * there is one.
+ */
 void collect_garbage(void);
+
+/**
+ * Do a slice of major collection work, no longer than vm.gc_pause_budget
+ * allows, starting a new collection if none is in progress. Without a
+ * budget, the marking is done in one slice. With vm.gc_concurrent, marking
+ * is left to a background thread and a slice only passes it the overwritten
+ * references or finishes the marking. Allocation sweeps the pages it is
+ * about to reuse, and slices sweep the rest.
+ */
+void collect_garbage_step(void);
 void free_objects(void);
 
+/**
+ * Settings of when major collections start.
+ */
+enum gc_setting {
+    // How many times larger the heap may grow than what a major collection
+    // left, before the next one starts.
+    GC_GROW_FACTOR,
+    // Heap size in bytes that starts the first major collection.
+    GC_INITIAL_HEAP,
+    // Heap size in bytes that starts a major collection even if the grow
+    // factor allows more. Zero for no limit.
+    GC_MAX_HEAP,
+    // Bytes to allocate after a major collection before the next one starts,
+    // however small the heap.
+    GC_MIN_INTERVAL,
+};
+
+/**
+ * Change a setting of when major collections start, taking effect from the
+ * end of the next one.
+ * @return Whether value is valid for the setting.
+ */
+bool gc_tune(enum gc_setting setting, f64 value);
+
+/**
+ * Count the objects in the heap by type, including the garbage that has not
+ * been freed yet.
+ * @param[out] counts One count for each type.
+ */
+void heap_census(size_t counts[OBJ_TYPE_COUNT]);
+
+/**
+ * Move the young object to the old generation, unless that already happened
+ * during this minor collection.
+ * @return The object's address in the old generation, or object itself if it
+ *         is NULL or already old. While the old generation is compacted, old
+ *         objects that were moved are also given their new address.
+ */
+struct obj *object_promote(struct obj *object);
+void value_promote(value_ty *value);
+
+/**
+ * Promote every young object reachable from the roots and the remembered
+ * set, then empty the nursery. Objects move, so this must only run where
+ * the VM holds no object pointers outside the roots.
+ */
+void collect_nursery(void);
+void nursery_init(void);
+void nursery_mark(void *memory);
+void remember_object(struct obj *object);
+
+static inline bool is_young(const struct obj *object)
+{
+    return (uintptr_t)object - (uintptr_t)vm.nursery < NURSERY_SIZE;
+}
+
+/**
+ * Bump-allocate size bytes in the nursery.
+ * @return The memory, or NULL when the nursery is full, in which case a
+ *         minor collection is requested for the next safepoint, or when size
+ *         is larger than NURSERY_MAX_OBJECT.
+ */
+static inline void *nursery_alloc(size_t size)
+{
+    size = NURSERY_ROUND(size);
+#ifdef DEBUG_STRESS_GC
+    collect_garbage_step();
+    // Pretend the nursery is full so that every safepoint runs a minor
+    // collection.
+    vm.nursery_full = true;
+#endif
+    if (size > NURSERY_MAX_OBJECT)
+        return NULL;
+    if (size > (size_t)(vm.nursery_end - vm.nursery_top)) {
+        vm.nursery_full = true;
+        return NULL;
+    }
+
+    void *memory = vm.nursery_top;
+    vm.nursery_top += size;
+    // Objects are allocated marked while a major collection is marking, as
+    // it only looks for what was reachable when it started.
+    if (vm.gc_phase == GC_MARK)
+        nursery_mark(memory);
+    return memory;
+}
+
+#ifdef CONCURRENT_MARKING
+// Fields that the marking thread reads while the program runs are accessed
+// atomically. A NaN-boxed value is one word, so this costs nothing.
+#define FIELD_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define FIELD_STORE(field, value) \
+    __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+void marker_pause(void);
+void marker_resume(void);
+#else
+#define FIELD_LOAD(field) (field)
+#define FIELD_STORE(field, value) ((field) = (value))
+#endif
+
+/**
+ * Keep the concurrent marking thread off the heap until the matching
+ * heap_unlock(). Changing the layout of an object it may be tracing, such as
+ * growing an array the object owns, has to happen in between. Calls nest,
+ * and no major collection starts or finishes in between.
+ */
+static inline void heap_lock(void)
+{
+#ifdef CONCURRENT_MARKING
+    if (vm.gc_concurrent && vm.heap_lock_depth++ == 0 &&
+        vm.gc_phase == GC_MARK)
+        marker_pause();
+#endif
+}
+
+static inline void heap_unlock(void)
+{
+#ifdef CONCURRENT_MARKING
+    if (vm.gc_concurrent && --vm.heap_lock_depth == 0 && vm.marker_paused)
+        marker_resume();
+#endif
+}
+
+/**
+ * Record that a reference to the object was overwritten or dropped while a
+ * major collection is marking, so that the object is marked as it would have
+ * been when the collection started.
+ */
+void object_shade(struct obj *object);
+
+/**
+ * Record a store of value into object over old. Every store into an object
+ * that has been allocated before has to go through here, so minor
+ * collections find the old-to-young pointers without tracing the old
+ * generation, and a major collection marks whatever was reachable when it
+ * started.
+ */
+static inline void write_barrier(struct obj *object, value_ty old,
+                                 value_ty value)
+{
+    if (IS_OBJ(old) && vm.gc_phase == GC_MARK)
+        object_shade(AS_OBJ(old));
+    if (IS_OBJ(value) && is_young(AS_OBJ(value)) && !is_young(object) &&
+        !object->is_remembered)
+        remember_object(object);
+}
+
+/**
+ * Overwrite a value field of object, which may be read by the marking
+ * thread.
+ */
+static inline void field_store(struct obj *object, value_ty *field,
+                               value_ty value)
+{
+    const value_ty old = *field;
+    FIELD_STORE(*field, value);
+    write_barrier(object, old, value);
+}
+
 #endif // CLOX__MEMORY_H_
@@ -1,10 +1,13 @@
 #include "object.h"
 
+#include "intern.h"
 #include "memory.h"
+#include "shape.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ALLOCATE_OBJ(type, obj_type) \
@@ -12,11 +15,22 @@
 
 static struct obj *alloc_object(size_t size, enum obj_type type)
 {
-    struct obj *object = reallocate(NULL, 0, size);
-    object->type = type;
-    object->is_marked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    struct obj *object = nursery_alloc(size);
+    if (object) {
+        object->type = type;
+        object->is_remembered = false;
+        object->next = NULL;
+    } else {
+        // The object is too large for the nursery, or the nursery is full
+        // until the next safepoint, so it goes straight to the old
+        // generation. Its fields are about to be set without a write
+        // barrier, so it starts out remembered.
+        object = object_allocate(size);
+        object->type = type;
+        object->is_remembered = false;
+        object->next = NULL;
+        remember_object(object);
+    }
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void *)object, size, type);
 #endif
@@ -39,6 +53,11 @@ struct obj_class *alloc_class(struct obj_string *name)
     klass->name = name;
     klass->initializer = NIL_VAL;
     table_init(&klass->methods);
+    klass->vtable = NULL;
+    klass->vtable_count = 0;
+    klass->vtable_capacity = 0;
+    klass->method_version = 0;
+    klass->instance_fields = 0;
     return klass;
 }
 
@@ -64,6 +83,7 @@ struct obj_function *alloc_function()
     struct obj_function *fn = ALLOCATE_OBJ(struct obj_function, OBJ_FUNCTION);
     fn->arity = 0;
     fn->upvalue_count = 0;
+    fn->max_locals = 0;
     fn->name = NULL;
     chunk_init(&fn->chunk);
     return fn;
@@ -71,13 +91,138 @@ struct obj_function *alloc_function()
 
 struct obj_instance *alloc_instance(struct obj_class *klass)
 {
-    struct obj_instance *instance =
-        ALLOCATE_OBJ(struct obj_instance, OBJ_INSTANCE);
+    const u32 capacity = klass->instance_fields ? klass->instance_fields
+                                                : INSTANCE_INLINE_FIELDS;
+    struct obj_instance *instance = (struct obj_instance *)alloc_object(
+        instance_size(capacity), OBJ_INSTANCE);
     instance->klass = klass;
-    table_init(&instance->fields);
+    instance->shape = vm.root_shape;
+    instance->fields = instance->inline_fields;
+    instance->field_capacity = capacity;
+    instance->inline_capacity = capacity;
     return instance;
 }
 
+i64 class_method_slot(const struct obj_class *klass,
+                      const struct obj_string *name)
+{
+    value_ty slot;
+    if (!table_get(&klass->methods, name, &slot))
+        return -1;
+    return (i64)AS_NUMBER(slot);
+}
+
+void class_set_method(struct obj_class *klass, struct obj_string *name,
+                      struct obj_closure *method)
+{
+    const i64 slot = class_method_slot(klass, name);
+    if (slot >= 0) {
+        struct method_slot *entry = &klass->vtable[slot];
+        const value_ty old = OBJ_VAL(entry->method);
+        FIELD_STORE(entry->method, method);
+        write_barrier(&klass->obj, old, OBJ_VAL(method));
+        klass->method_version++;
+        return;
+    }
+
+    heap_lock();
+    if (klass->vtable_capacity < klass->vtable_count + 1) {
+        const size_t old_capacity = klass->vtable_capacity;
+        klass->vtable_capacity = GROW_CAPACITY(old_capacity);
+        klass->vtable = GROW_ARRAY(struct method_slot, klass->vtable,
+                                   old_capacity, klass->vtable_capacity);
+    }
+    klass->vtable[klass->vtable_count++] = (struct method_slot){name, method};
+    table_set(&klass->methods, name,
+              NUMBER_VAL((f64)(klass->vtable_count - 1)));
+    heap_unlock();
+    write_barrier(&klass->obj, NIL_VAL, OBJ_VAL(name));
+    write_barrier(&klass->obj, NIL_VAL, OBJ_VAL(method));
+    klass->method_version++;
+}
+
+void class_inherit(struct obj_class *subclass,
+                   const struct obj_class *superclass)
+{
+    const size_t count = superclass->vtable_count;
+    heap_lock();
+    table_add_all(&superclass->methods, &subclass->methods);
+    subclass->vtable = GROW_ARRAY(struct method_slot, subclass->vtable,
+                                  subclass->vtable_capacity, count);
+    subclass->vtable_capacity = count;
+    subclass->vtable_count = count;
+    if (count > 0)
+        memcpy(subclass->vtable, superclass->vtable,
+               sizeof(struct method_slot) * count);
+    subclass->initializer = superclass->initializer;
+    heap_unlock();
+
+    // The subclass has no methods of its own yet, so nothing is
+    // overwritten.
+    for (size_t i = 0; i < count; i++) {
+        write_barrier(&subclass->obj, NIL_VAL,
+                      OBJ_VAL(subclass->vtable[i].name));
+        write_barrier(&subclass->obj, NIL_VAL,
+                      OBJ_VAL(subclass->vtable[i].method));
+    }
+    subclass->method_version++;
+}
+
+bool instance_get_field(const struct obj_instance *instance,
+                        const struct obj_string *name, value_ty *value)
+{
+    const i64 slot = shape_lookup(instance->shape, name);
+    if (slot < 0)
+        return false;
+
+    *value = instance->fields[slot];
+    return true;
+}
+
+void instance_add_field(struct obj_instance *instance, struct shape *shape,
+                        value_ty value)
+{
+    struct obj_class *klass = instance->klass;
+    if (klass->instance_fields < shape->slot_count &&
+        shape->slot_count <= INSTANCE_MAX_INLINE_FIELDS)
+        klass->instance_fields = (u32)shape->slot_count;
+
+    heap_lock();
+    if (instance->field_capacity < shape->slot_count) {
+        const u32 old_capacity = instance->field_capacity;
+        const u32 capacity = GROW_CAPACITY(old_capacity);
+        if (instance->fields == instance->inline_fields) {
+            value_ty *fields = ALLOCATE(value_ty, capacity);
+            memcpy(fields, instance->inline_fields,
+                   sizeof(value_ty) * old_capacity);
+            instance->fields = fields;
+        } else {
+            instance->fields = GROW_ARRAY(value_ty, instance->fields,
+                                          old_capacity, capacity);
+        }
+        instance->field_capacity = capacity;
+    }
+
+    instance->fields[shape->slot_count - 1] = value;
+    instance->shape = shape;
+    heap_unlock();
+    write_barrier(&instance->obj, NIL_VAL, value);
+}
+
+size_t instance_set_field(struct obj_instance *instance,
+                          struct obj_string *name, value_ty value)
+{
+    const i64 slot = shape_lookup(instance->shape, name);
+    if (slot >= 0) {
+        field_store(&instance->obj, &instance->fields[slot], value);
+        return (size_t)slot;
+    }
+
+    struct shape *shape = shape_transition(instance->shape, name);
+    instance_add_field(instance, shape, value);
+    return shape->slot_count - 1;
+}
+
 struct obj_native *alloc_native(native_fn fn)
 {
     struct obj_native *native = ALLOCATE_OBJ(struct obj_native, OBJ_NATIVE);
@@ -85,21 +230,74 @@ struct obj_native *alloc_native(native_fn fn)
     return native;
 }
 
-static struct obj_string *alloc_string(char *chars, size_t length, u32 hash)
+struct obj_string *alloc_string(size_t length)
 {
-    struct obj_string *string = ALLOCATE_OBJ(struct obj_string, OBJ_STRING);
-    string->chars = chars;
+    struct obj_string *string =
+        (struct obj_string *)alloc_object(string_size(length), OBJ_STRING);
     string->length = length;
-    string->hash = hash;
+    string->chars[length] = '\0';
+    return string;
+}
 
-    push(OBJ_VAL(string));
-    table_set(&vm.strings, string, NIL_VAL);
-    pop();
+// The table of interned strings holds them weakly, so a string found there
+// while a major collection is marking may be one it is about to free.
+static const struct obj_string *find_interned(const char *chars,
+                                              size_t length, u32 hash)
+{
+    const struct obj_string *interned =
+        intern_set_find(&vm.strings, chars, length, hash);
 
-    return string;
+    if (interned && vm.gc_phase == GC_MARK)
+        object_shade((struct obj *)interned);
+    return interned;
+}
+
+#ifdef FAST_STRING_HASH
+static u64 load_u64(const char *bytes)
+{
+    u64 word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static u64 load_u32(const char *bytes)
+{
+    u32 word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static u64 hash_mix(u64 hash, u64 word)
+{
+    hash = (hash ^ word) * 0xbf58476d1ce4e5b9u;
+    return hash ^ (hash >> 31);
 }
 
-static u32 hash_string(const char *key, size_t length)
+// Hash eight bytes at a time. The last one to eight bytes are read as
+// overlapping or repeated loads, which the length mixed in at the start
+// tells apart. The final multiply and shift spread every input bit into the
+// low bits that tables mask the hash down to.
+u32 hash_string(const char *key, size_t length)
+{
+    u64 hash = (u64)length * 0x9e3779b97f4a7c15u;
+    const char *end = key + length;
+    for (; end - key > 8; key += 8) {
+        hash = hash_mix(hash, load_u64(key));
+    }
+
+    const size_t rest = (size_t)(end - key);
+    u64 word = 0;
+    if (rest >= 4) {
+        word = load_u32(key) | load_u32(end - 4) << 32;
+    } else if (rest > 0) {
+        word = (u64)(u8)key[0] | (u64)(u8)key[rest / 2] << 8 |
+               (u64)(u8)end[-1] << 16;
+    }
+    hash = hash_mix(hash, word) * 0x94d049bb133111ebu;
+    return (u32)(hash ^ (hash >> 32));
+}
+#else
+u32 hash_string(const char *key, size_t length)
 {
     u32 hash = 2166136261u;
     for (size_t i = 0; i < length; i++) {
@@ -108,33 +306,102 @@ static u32 hash_string(const char *key, size_t length)
     }
     return hash;
 }
+#endif
 
-const struct obj_string *take_string(char *chars, size_t length)
+static const struct obj_string *add_interned(struct obj_string *string)
 {
-    const u32 hash = hash_string(chars, length);
+    push(OBJ_VAL(string));
+    intern_set_add(&vm.strings, string);
+    pop();
+    return string;
+}
+
+const struct obj_string *intern_string(struct obj_string *string)
+{
+    string->hash = hash_string(string->chars, string->length);
     const struct obj_string *interned =
-        table_find_string(&vm.strings, chars, length, hash);
+        find_interned(string->chars, string->length, string->hash);
 
-    if (interned) {
-        FREE_ARRAY(char, chars, length + 1);
+    // The duplicate is garbage, which is cheap to leave to the nursery.
+    if (interned)
         return interned;
-    }
-    return alloc_string(chars, length, hash);
+    return add_interned(string);
 }
 
 const struct obj_string *copy_string(const char *chars, size_t length)
 {
     const u32 hash = hash_string(chars, length);
-    const struct obj_string *interned =
-        table_find_string(&vm.strings, chars, length, hash);
+    const struct obj_string *interned = find_interned(chars, length, hash);
 
     if (interned)
         return interned;
 
-    char *heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return alloc_string(heap_chars, length, hash);
+    struct obj_string *string = alloc_string(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return add_interned(string);
+}
+
+struct obj_rope *alloc_rope(value_ty left, value_ty right)
+{
+    // Ropes that were flattened are skipped in favor of their string.
+    if (IS_ROPE(left) && !IS_NIL(AS_ROPE(left)->flat))
+        left = AS_ROPE(left)->flat;
+    if (IS_ROPE(right) && !IS_NIL(AS_ROPE(right)->flat))
+        right = AS_ROPE(right)->flat;
+
+    const u32 left_depth = IS_ROPE(left) ? AS_ROPE(left)->depth : 0;
+    const u32 right_depth = IS_ROPE(right) ? AS_ROPE(right)->depth : 0;
+
+    struct obj_rope *rope = ALLOCATE_OBJ(struct obj_rope, OBJ_ROPE);
+    rope->length = text_length(left) + text_length(right);
+    rope->depth = (left_depth > right_depth ? left_depth : right_depth) + 1;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NIL_VAL;
+    return rope;
+}
+
+// Copy the characters of an unflattened rope to dest, walking it with an
+// explicit stack, as appending in a loop makes ropes very deep.
+static void rope_copy(const struct obj_rope *rope, char *dest)
+{
+    const value_ty **pending = malloc(sizeof(value_ty *) * (rope->depth + 1));
+    if (!pending)
+        exit(1);
+
+    size_t count = 0;
+    pending[count++] = &rope->right;
+    pending[count++] = &rope->left;
+    while (count > 0) {
+        const value_ty part = *pending[--count];
+        if (IS_ROPE(part) && IS_NIL(AS_ROPE(part)->flat)) {
+            pending[count++] = &AS_ROPE(part)->right;
+            pending[count++] = &AS_ROPE(part)->left;
+            continue;
+        }
+
+        const struct obj_string *string =
+            IS_ROPE(part) ? AS_STRING(AS_ROPE(part)->flat) : AS_STRING(part);
+        memcpy(dest, string->chars, string->length);
+        dest += string->length;
+    }
+    free(pending);
+}
+
+const struct obj_string *rope_flatten(struct obj_rope *rope)
+{
+    if (!IS_NIL(rope->flat))
+        return AS_STRING(rope->flat);
+
+    struct obj_string *string = alloc_string(rope->length);
+    rope_copy(rope, string->chars);
+    const struct obj_string *flat = intern_string(string);
+
+    field_store(&rope->obj, &rope->flat, OBJ_VAL(flat));
+    field_store(&rope->obj, &rope->left, NIL_VAL);
+    field_store(&rope->obj, &rope->right, NIL_VAL);
+    return flat;
 }
 
 struct obj_upvalue *alloc_upvalue(value_ty *slot)
@@ -164,6 +431,22 @@ void object_print(value_ty value)
     case OBJ_STRING:
         printf("%s", AS_CSTRING(value));
         break;
+    case OBJ_ROPE: {
+        // Printing must not allocate, as the collector prints objects when
+        // it logs.
+        const struct obj_rope *rope = AS_ROPE(value);
+        if (!IS_NIL(rope->flat)) {
+            printf("%s", AS_CSTRING(rope->flat));
+            break;
+        }
+        char *chars = malloc(rope->length);
+        if (!chars)
+            exit(1);
+        rope_copy(rope, chars);
+        fwrite(chars, 1, rope->length, stdout);
+        free(chars);
+        break;
+    }
     case OBJ_FUNCTION:
         function_print(AS_FUNCTION(value));
         break;
@@ -184,3 +467,28 @@ void object_print(value_ty value)
         break;
     }
 }
+
+const char *object_type_name(enum obj_type type)
+{
+    switch (type) {
+    case OBJ_BOUND_METHOD:
+        return "BoundMethod";
+    case OBJ_CLASS:
+        return "Class";
+    case OBJ_CLOSURE:
+        return "Closure";
+    case OBJ_FUNCTION:
+        return "Function";
+    case OBJ_INSTANCE:
+        return "Instance";
+    case OBJ_NATIVE:
+        return "Native";
+    case OBJ_ROPE:
+        return "Rope";
+    case OBJ_STRING:
+        return "String";
+    case OBJ_UPVALUE:
+        return "Upvalue";
+    }
+    return "";
+}
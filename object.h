@@ -6,6 +6,8 @@
 #include "table.h"
 #include "value.h"
 
+struct shape;
+
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value) is_obj_type(value, OBJ_BOUND_METHOD)
@@ -14,6 +16,7 @@
 #define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
+#define IS_ROPE(value) is_obj_type(value, OBJ_ROPE)
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((struct obj_bound_method *)AS_OBJ(value))
@@ -22,6 +25,7 @@
 #define AS_FUNCTION(value) ((struct obj_function *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((struct obj_instance *)AS_OBJ(value))
 #define AS_NATIVE(value) (((struct obj_native *)AS_OBJ(value))->fn)
+#define AS_ROPE(value) ((struct obj_rope *)AS_OBJ(value))
 #define AS_STRING(value) ((struct obj_string *)AS_OBJ(value))
 #define AS_CSTRING(value) (((struct obj_string *)AS_OBJ(value))->chars)
 
@@ -32,13 +36,19 @@ enum obj_type {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_ROPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 };
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 struct obj {
     enum obj_type type;
-    bool is_marked;
+    // Whether the object is in vm.remembered.
+    bool is_remembered;
+    // For a young object, its copy in the old generation once it has been
+    // promoted.
     struct obj *next;
 };
 
@@ -46,6 +56,8 @@ struct obj_function {
     struct obj obj;
     i32 arity;
     i32 upvalue_count;
+    // Most locals live at once, which the frame needs stack space for.
+    i32 max_locals;
     struct chunk chunk;
     const struct obj_string *name;
 };
@@ -60,8 +72,31 @@ struct obj_native {
 struct obj_string {
     struct obj obj;
     size_t length;
-    char *chars;
     u32 hash;
+    // Null-terminated, in the same allocation as the rest of the string.
+    char chars[];
+};
+
+// Concatenations shorter than this are copied right away rather than kept
+// as ropes.
+#define ROPE_MIN_LENGTH 256
+
+/**
+ * The concatenation of two strings or ropes, which is only copied into a
+ * string of its own when it is compared. Repeatedly appending to a rope
+ * takes linear time rather than quadratic.
+ */
+struct obj_rope {
+    struct obj obj;
+    size_t length;
+    // Longest path to a string, which bounds the halves pending while the
+    // rope is walked.
+    u32 depth;
+    // The halves until the rope is flattened, nil afterwards.
+    value_ty left;
+    value_ty right;
+    // The interned string the rope was flattened into, or nil.
+    value_ty flat;
 };
 
 struct obj_upvalue {
@@ -78,17 +113,45 @@ struct obj_closure {
     i32 upvalue_count;
 };
 
+struct method_slot {
+    struct obj_string *name;
+    struct obj_closure *method;
+};
+
 struct obj_class {
     struct obj obj;
     struct obj_string *name;
     value_ty initializer;
+    // Maps the names of the methods to their slots in vtable.
     struct table methods;
+    // The methods by slot. A subclass's vtable starts with a copy of its
+    // superclass's, so a method keeps its slot down the hierarchy.
+    struct method_slot *vtable;
+    size_t vtable_count;
+    size_t vtable_capacity;
+    // Bumped whenever methods changes, invalidating invoke caches.
+    u32 method_version;
+    // The most fields an instance of the class has had, which new instances
+    // make room for inline. Zero until an instance gets a field.
+    u32 instance_fields;
 };
 
+// Fields an instance keeps inside the object itself while its class has not
+// seen how many its instances get, and the most it keeps once it has. More
+// fields spill into an array of their own.
+#define INSTANCE_INLINE_FIELDS 4
+#define INSTANCE_MAX_INLINE_FIELDS 32
+
 struct obj_instance {
     struct obj obj;
     struct obj_class *klass;
-    struct table fields;
+    // Layout of fields, which holds shape->slot_count values.
+    struct shape *shape;
+    // Points at inline_fields until there are more fields than fit there.
+    value_ty *fields;
+    u32 field_capacity;
+    u32 inline_capacity;
+    value_ty inline_fields[];
 };
 
 struct obj_bound_method {
@@ -104,14 +167,106 @@ struct obj_closure *alloc_closure(struct obj_function *fn);
 struct obj_function *alloc_function();
 struct obj_instance *alloc_instance(struct obj_class *klass);
 struct obj_native *alloc_native(native_fn fn);
-const struct obj_string *take_string(char *chars, size_t length);
+bool instance_get_field(const struct obj_instance *instance,
+                        const struct obj_string *name, value_ty *value);
+
+/**
+ * Find the slot of a method in the class's vtable.
+ * @return The slot, or -1 if the class has no method with the name.
+ */
+i64 class_method_slot(const struct obj_class *klass,
+                      const struct obj_string *name);
+
+/**
+ * Define a method, overwriting the one with the same name in its slot or
+ * appending it to the vtable.
+ */
+void class_set_method(struct obj_class *klass, struct obj_string *name,
+                      struct obj_closure *method);
+
+/**
+ * Copy the methods of superclass into subclass, which has none of its own
+ * yet, keeping their slots.
+ */
+void class_inherit(struct obj_class *subclass,
+                   const struct obj_class *superclass);
+
+/**
+ * Append a field to the instance.
+ * @param shape The instance's shape after adding the field.
+ */
+void instance_add_field(struct obj_instance *instance, struct shape *shape,
+                        value_ty value);
+
+/**
+ * Set a field, adding it to the instance if it doesn't exist yet.
+ * @return The slot index of the field.
+ */
+size_t instance_set_field(struct obj_instance *instance,
+                          struct obj_string *name, value_ty value);
+
+/**
+ * Hash the characters of a string, as the interned strings and the tables
+ * keyed by them do.
+ */
+u32 hash_string(const char *key, size_t length);
+
+/**
+ * Allocate a string of length characters, which the caller fills in before
+ * passing the string to intern_string().
+ */
+struct obj_string *alloc_string(size_t length);
+
+/**
+ * Add a string from alloc_string() to the interned strings.
+ * @return The string, or the interned string equal to it if there is one
+ *         already, in which case the string is dropped.
+ */
+const struct obj_string *intern_string(struct obj_string *string);
 const struct obj_string *copy_string(const char *chars, size_t length);
+
+/**
+ * Concatenate two strings or ropes without copying them.
+ */
+struct obj_rope *alloc_rope(value_ty left, value_ty right);
+
+/**
+ * Copy the characters of the rope into an interned string, which the rope
+ * keeps in place of its halves. The rope must be reachable by the collector.
+ * @return The string.
+ */
+const struct obj_string *rope_flatten(struct obj_rope *rope);
 struct obj_upvalue *alloc_upvalue(value_ty *slot);
 void object_print(value_ty value);
+const char *object_type_name(enum obj_type type);
+
+static inline size_t string_size(size_t length)
+{
+    return offsetof(struct obj_string, chars) + length + 1;
+}
+
+static inline size_t instance_size(size_t inline_capacity)
+{
+    return offsetof(struct obj_instance, inline_fields) +
+           sizeof(value_ty) * inline_capacity;
+}
 
 static inline bool is_obj_type(value_ty v, enum obj_type type)
 {
     return IS_OBJ(v) && (AS_OBJ(v)->type == type);
 }
 
+// Whether the value is a string or a rope, which are interchangeable to the
+// program.
+static inline bool is_text(value_ty v)
+{
+    return IS_OBJ(v) &&
+           (AS_OBJ(v)->type == OBJ_STRING || AS_OBJ(v)->type == OBJ_ROPE);
+}
+
+static inline size_t text_length(value_ty v)
+{
+    return IS_ROPE(v) ? AS_ROPE(v)->length : AS_STRING(v)->length;
+}
+
 #endif // CLOX__OBJECT_H_
@@ -0,0 +1,393 @@
+#include "optimizer.h"
+
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+
+struct instruction {
+    // Position in the unoptimized chunk.
+    size_t offset;
+    size_t length;
+    // Opcode to emit, which differs from the original for fused instructions.
+    // Jumps are kept in their short form until the layout is known.
+    u8 op;
+    // For jumps, the index of the instruction jumped to.
+    size_t target;
+    // For OP_POPN, the number of values popped.
+    u8 pop_count;
+    bool live;
+    bool reachable;
+    bool is_target;
+    // Set for jumps that need the long form in the new layout.
+    bool wide;
+    size_t new_offset;
+};
+
+struct optimizer {
+    struct chunk *chunk;
+    struct instruction *code;
+    size_t count;
+};
+
+static bool is_jump(u8 op)
+{
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE ||
+           op == OP_LOOP;
+}
+
+static bool is_conditional_jump(u8 op)
+{
+    return op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+}
+
+static bool is_long_jump(u8 op)
+{
+    return op == OP_JUMP_LONG || op == OP_JUMP_IF_FALSE_LONG ||
+           op == OP_JUMP_IF_TRUE_LONG || op == OP_LOOP_LONG;
+}
+
+static size_t find_instruction(const struct optimizer *opt, size_t offset)
+{
+    size_t start = 0;
+    size_t end = opt->count;
+
+    while (start < end) {
+        const size_t mid = (start + end) / 2;
+        if (opt->code[mid].offset < offset) {
+            start = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+
+    if (start == opt->count || opt->code[start].offset != offset)
+        return SIZE_MAX;
+    return start;
+}
+
+// Removed instructions are replaced by the first live one after them, which
+// is also where jumps to them land.
+static size_t resolve(const struct optimizer *opt, size_t index)
+{
+    while (index < opt->count && !opt->code[index].live)
+        index++;
+    return index;
+}
+
+static bool decode(struct optimizer *opt)
+{
+    const struct chunk *chunk = opt->chunk;
+
+    opt->count = 0;
+    for (size_t offset = 0; offset < chunk->size;
+         offset += chunk_instruction_length(chunk, offset))
+        opt->count++;
+
+    opt->code = ALLOCATE(struct instruction, opt->count);
+
+    size_t offset = 0;
+    for (size_t i = 0; i < opt->count; i++) {
+        struct instruction *insn = &opt->code[i];
+        insn->offset = offset;
+        insn->length = chunk_instruction_length(chunk, offset);
+        insn->op = chunk->code[offset];
+        if (is_long_jump(insn->op))
+            insn->op--;
+        insn->target = 0;
+        insn->pop_count = 0;
+        insn->live = true;
+        insn->reachable = false;
+        insn->is_target = false;
+        insn->wide = false;
+        insn->new_offset = 0;
+        offset += insn->length;
+    }
+
+    for (size_t i = 0; i < opt->count; i++) {
+        struct instruction *insn = &opt->code[i];
+        if (!is_jump(insn->op))
+            continue;
+
+        size_t jump = 0;
+        for (size_t j = 1; j < insn->length; j++) {
+            jump = (jump << 8) | chunk->code[insn->offset + j];
+        }
+        const size_t next = insn->offset + insn->length;
+        const size_t target =
+            insn->op == OP_LOOP ? next - jump : next + jump;
+
+        insn->target = find_instruction(opt, target);
+        if (insn->target == SIZE_MAX)
+            return false;
+        opt->code[insn->target].is_target = true;
+    }
+
+    return true;
+}
+
+// OP_NOT followed by OP_JUMP_IF_FALSE becomes OP_JUMP_IF_TRUE on the original
+// operand. That leaves a different value on the stack, so it is only done
+// when both successors pop it straight away.
+static void fuse_not_jumps(struct optimizer *opt)
+{
+    for (size_t i = 0; i + 2 < opt->count; i++) {
+        struct instruction *negate = &opt->code[i];
+        struct instruction *jump = &opt->code[i + 1];
+
+        if (negate->op != OP_NOT || jump->op != OP_JUMP_IF_FALSE ||
+            jump->is_target)
+            continue;
+        if (opt->code[i + 2].op != OP_POP ||
+            opt->code[jump->target].op != OP_POP)
+            continue;
+
+        negate->live = false;
+        jump->op = OP_JUMP_IF_TRUE;
+    }
+}
+
+// The code only shrinks, so a jump that fits the long form in the original
+// layout still fits after optimization.
+static bool jump_fits(const struct optimizer *opt, size_t from, size_t to)
+{
+    const size_t next = opt->code[from].offset + opt->code[from].length;
+    const size_t target = opt->code[to].offset;
+    const size_t distance = target >= next ? target - next : next - target;
+    return distance <= UINT24_MAX;
+}
+
+// Retarget jumps whose destination is another jump to where that one ends up.
+static void thread_jumps(struct optimizer *opt)
+{
+    for (size_t i = 0; i < opt->count; i++) {
+        struct instruction *insn = &opt->code[i];
+        if (!insn->live || !is_jump(insn->op))
+            continue;
+
+        const bool conditional = is_conditional_jump(insn->op);
+        for (size_t steps = 0; steps < opt->count; steps++) {
+            const size_t to = resolve(opt, insn->target);
+            const struct instruction *dest = &opt->code[to];
+            size_t next;
+
+            if (dest->op == OP_JUMP || dest->op == OP_LOOP) {
+                next = dest->target;
+            } else if (conditional && dest->op == insn->op) {
+                // The tested value is still on the stack, so the second
+                // jump is taken as well.
+                next = dest->target;
+            } else if (conditional && is_conditional_jump(dest->op)) {
+                // ...and the opposite test falls through.
+                next = to + 1;
+            } else {
+                break;
+            }
+
+            if (next == i || (conditional && next < i) ||
+                resolve(opt, next) == opt->count ||
+                !jump_fits(opt, i, resolve(opt, next)))
+                break;
+            insn->target = next;
+        }
+    }
+}
+
+static void remove_unreachable(struct optimizer *opt)
+{
+    size_t *worklist = ALLOCATE(size_t, opt->count * 2 + 1);
+    size_t top = 0;
+
+    worklist[top++] = resolve(opt, 0);
+    while (top > 0) {
+        const size_t i = worklist[--top];
+        if (i >= opt->count || opt->code[i].reachable)
+            continue;
+
+        struct instruction *insn = &opt->code[i];
+        insn->reachable = true;
+
+        if (is_jump(insn->op))
+            worklist[top++] = resolve(opt, insn->target);
+        if (insn->op != OP_JUMP && insn->op != OP_LOOP &&
+            insn->op != OP_RETURN)
+            worklist[top++] = resolve(opt, i + 1);
+    }
+
+    for (size_t i = 0; i < opt->count; i++) {
+        if (!opt->code[i].reachable)
+            opt->code[i].live = false;
+    }
+
+    FREE_ARRAY(size_t, worklist, opt->count * 2 + 1);
+}
+
+// Forward jumps to the instruction right after them do nothing. Walking
+// backwards lets a chain of them collapse in one pass.
+static void remove_empty_jumps(struct optimizer *opt)
+{
+    for (size_t i = opt->count; i-- > 0;) {
+        struct instruction *insn = &opt->code[i];
+        if (!insn->live || !is_jump(insn->op) || insn->op == OP_LOOP)
+            continue;
+
+        if (resolve(opt, insn->target) == resolve(opt, i + 1))
+            insn->live = false;
+    }
+}
+
+static void merge_pops(struct optimizer *opt)
+{
+    for (size_t i = 0; i < opt->count; i++) {
+        opt->code[i].is_target = false;
+    }
+    for (size_t i = 0; i < opt->count; i++) {
+        const struct instruction *insn = &opt->code[i];
+        if (insn->live && is_jump(insn->op))
+            opt->code[resolve(opt, insn->target)].is_target = true;
+    }
+
+    for (size_t i = 0; i < opt->count; i++) {
+        struct instruction *insn = &opt->code[i];
+        if (!insn->live || insn->op != OP_POP)
+            continue;
+
+        // A jump into the middle of the run needs its own OP_POP.
+        u8 pop_count = 1;
+        size_t next = resolve(opt, i + 1);
+        while (next < opt->count && opt->code[next].op == OP_POP &&
+               !opt->code[next].is_target && pop_count < UINT8_MAX) {
+            opt->code[next].live = false;
+            pop_count++;
+            next = resolve(opt, next + 1);
+        }
+
+        if (pop_count > 1) {
+            insn->op = OP_POPN;
+            insn->pop_count = pop_count;
+        }
+    }
+}
+
+static size_t new_length(const struct instruction *insn)
+{
+    if (is_jump(insn->op))
+        return insn->wide ? 4 : 3;
+    if (insn->op == OP_POPN)
+        return 2;
+    return insn->length;
+}
+
+// Distance from the end of the jump to its target in the new layout.
+static size_t jump_distance(const struct optimizer *opt,
+                            const struct instruction *insn, bool *backward)
+{
+    const size_t next = insn->new_offset + new_length(insn);
+    const size_t target = opt->code[resolve(opt, insn->target)].new_offset;
+
+    *backward = target < next;
+    return *backward ? next - target : target - next;
+}
+
+// Assign new offsets, starting with every jump in its short form and
+// widening the ones that do not fit until nothing changes. Widening only
+// ever moves code apart, so this terminates.
+static void layout(struct optimizer *opt)
+{
+    for (;;) {
+        size_t offset = 0;
+        for (size_t i = 0; i < opt->count; i++) {
+            struct instruction *insn = &opt->code[i];
+            if (!insn->live)
+                continue;
+            insn->new_offset = offset;
+            offset += new_length(insn);
+        }
+
+        bool widened = false;
+        for (size_t i = 0; i < opt->count; i++) {
+            struct instruction *insn = &opt->code[i];
+            if (!insn->live || !is_jump(insn->op) || insn->wide)
+                continue;
+
+            bool backward;
+            if (jump_distance(opt, insn, &backward) > UINT16_MAX) {
+                insn->wide = true;
+                widened = true;
+            }
+        }
+
+        if (!widened)
+            return;
+    }
+}
+
+static void emit(struct optimizer *opt)
+{
+    struct chunk *chunk = opt->chunk;
+    struct chunk out;
+    chunk_init(&out);
+
+    for (size_t i = 0; i < opt->count; i++) {
+        const struct instruction *insn = &opt->code[i];
+        if (!insn->live)
+            continue;
+
+        const size_t line = chunk_getline(chunk, insn->offset);
+
+        if (is_jump(insn->op)) {
+            bool backward;
+            const size_t jump = jump_distance(opt, insn, &backward);
+            u8 op = insn->op;
+
+            if (op == OP_JUMP && backward) {
+                op = OP_LOOP;
+            } else if (op == OP_LOOP && !backward) {
+                op = OP_JUMP;
+            }
+
+            if (insn->wide) {
+                // The long form directly follows the short one.
+                chunk_write(&out, (u8)(op + 1), line);
+                chunk_write(&out, (u8)(jump >> 16), line);
+            } else {
+                chunk_write(&out, op, line);
+            }
+            chunk_write(&out, (u8)(jump >> 8), line);
+            chunk_write(&out, (u8)jump, line);
+        } else if (insn->op == OP_POPN) {
+            chunk_write(&out, OP_POPN, line);
+            chunk_write(&out, insn->pop_count, line);
+        } else {
+            for (size_t j = 0; j < insn->length; j++) {
+                chunk_write(&out, chunk->code[insn->offset + j], line);
+            }
+        }
+    }
+
+    FREE_ARRAY(u8, chunk->code, chunk->capacity);
+    FREE_ARRAY(struct line_start, chunk->lines, chunk->line_capacity);
+    chunk->code = out.code;
+    chunk->size = out.size;
+    chunk->capacity = out.capacity;
+    chunk->lines = out.lines;
+    chunk->line_count = out.line_count;
+    chunk->line_capacity = out.line_capacity;
+}
+
+void optimize_chunk(struct chunk *chunk)
+{
+    struct optimizer opt;
+    opt.chunk = chunk;
+
+    if (decode(&opt)) {
+        fuse_not_jumps(&opt);
+        thread_jumps(&opt);
+        remove_unreachable(&opt);
+        remove_empty_jumps(&opt);
+        merge_pops(&opt);
+        layout(&opt);
+        emit(&opt);
+    }
+
+    FREE_ARRAY(struct instruction, opt.code, opt.count);
+}
@@ -0,0 +1,15 @@
+#ifndef CLOX__OPTIMIZER_H_
+#define CLOX__OPTIMIZER_H_
+
+#include "chunk.h"
+
+/**
+ * Peephole pass over a finished chunk. Fuses OP_NOT into the conditional jump
+ * after it, threads jumps to jumps, merges runs of OP_POP into OP_POPN and
+ * drops unreachable code. Jump offsets and the line table are rebuilt for
+ * the new layout, in which each jump takes its short form if it fits.
+ * Constants and inline caches are left untouched.
+ */
+void optimize_chunk(struct chunk *chunk);
+
+#endif // CLOX__OPTIMIZER_H_
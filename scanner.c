@@ -2,12 +2,6 @@
 
 #include <string.h>
 
-struct scanner {
-    const char *start;
-    const char *current;
-    size_t line;
-};
-
 static struct scanner scanner;
 
 void scanner_init(const char *source)
@@ -17,6 +11,16 @@ void scanner_init(const char *source)
     scanner.line = 1;
 }
 
+struct scanner scanner_save(void)
+{
+    return scanner;
+}
+
+void scanner_restore(struct scanner state)
+{
+    scanner = state;
+}
+
 static bool is_alpha(char c)
 {
     return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) ||
@@ -58,7 +58,20 @@ struct token {
     size_t line;
 };
 
+struct scanner {
+    const char *start;
+    const char *current;
+    size_t line;
+};
+
 void scanner_init(const char *source);
 struct token scanner_scan_token(void);
 
+/**
+ * Snapshot the scanner position, so the caller can look ahead and rewind
+ * with scanner_restore().
+ */
+struct scanner scanner_save(void);
+void scanner_restore(struct scanner state);
+
 #endif // CLOX__SCANNER_H_
@@ -0,0 +1,100 @@
+#include "shape.h"
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// Up to this many fields a walk up the parent chain is cheaper than
+// building and probing a hash table.
+#define SHAPE_LINEAR_LOOKUP_MAX 8
+
+static struct shape *alloc_shape(struct shape *parent, struct obj_string *key)
+{
+    struct shape *shape = ALLOCATE(struct shape, 1);
+    shape->parent = parent;
+    shape->key = key;
+    shape->slot_count = parent ? parent->slot_count + 1 : 0;
+    shape->children = NULL;
+    shape->sibling = NULL;
+    table_init(&shape->slots);
+
+    shape->next = vm.shapes;
+    vm.shapes = shape;
+    return shape;
+}
+
+struct shape *shape_new_root(void)
+{
+    return alloc_shape(NULL, NULL);
+}
+
+struct shape *shape_transition(struct shape *shape, struct obj_string *key)
+{
+    for (struct shape *child = shape->children; child;
+         child = child->sibling) {
+        if (child->key == key)
+            return child;
+    }
+
+    struct shape *child = alloc_shape(shape, key);
+    child->sibling = shape->children;
+    shape->children = child;
+    return child;
+}
+
+static void build_slots(struct shape *shape)
+{
+    for (const struct shape *s = shape; s->key; s = s->parent) {
+        table_set(&shape->slots, s->key, NUMBER_VAL((f64)(s->slot_count - 1)));
+    }
+}
+
+i64 shape_lookup(struct shape *shape, const struct obj_string *key)
+{
+    if (shape->slot_count <= SHAPE_LINEAR_LOOKUP_MAX) {
+        for (const struct shape *s = shape; s->key; s = s->parent) {
+            if (s->key == key)
+                return (i64)s->slot_count - 1;
+        }
+        return -1;
+    }
+
+    if (shape->slots.len == 0)
+        build_slots(shape);
+
+    value_ty slot;
+    if (!table_get(&shape->slots, key, &slot))
+        return -1;
+
+    return (i64)AS_NUMBER(slot);
+}
+
+void shapes_mark(void)
+{
+    for (const struct shape *shape = vm.shapes; shape; shape = shape->next) {
+        object_mark((struct obj *)shape->key);
+    }
+}
+
+void shapes_promote(void)
+{
+    for (struct shape *shape = vm.shapes; shape; shape = shape->next) {
+        shape->key =
+            (struct obj_string *)object_promote((struct obj *)shape->key);
+        table_promote(&shape->slots);
+    }
+}
+
+void shapes_free(void)
+{
+    struct shape *shape = vm.shapes;
+    while (shape) {
+        struct shape *next = shape->next;
+        table_free(&shape->slots);
+        FREE(struct shape, shape);
+        shape = next;
+    }
+    vm.shapes = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef CLOX__SHAPE_H_
+#define CLOX__SHAPE_H_
+
+#include "common.h"
+#include "table.h"
+
+/**
+ * A shape describes the field layout shared by every instance that had the
+ * same fields added in the same order. Field values live in the instance's
+ * slot array, at the index the shape assigns to each name.
+ *
+ * Shapes form a transition tree rooted at vm.root_shape and are never freed
+ * before vm_free(), so raw shape pointers can be cached in bytecode.
+ */
+struct shape {
+    struct shape *parent;
+    // The field added by the transition from parent, NULL for the root.
+    struct obj_string *key;
+    // Number of fields, the slot of key is slot_count - 1.
+    size_t slot_count;
+    struct shape *children;
+    struct shape *sibling;
+    // Name -> slot lookup for large shapes, built on first use.
+    struct table slots;
+    // Links every shape in the VM for marking and freeing.
+    struct shape *next;
+};
+
+struct shape *shape_new_root(void);
+
+/**
+ * Get the shape reached by adding a field named key to shape.
+ * The transition is created on first use and shared afterwards.
+ */
+struct shape *shape_transition(struct shape *shape, struct obj_string *key);
+
+/**
+ * Find the slot index of key in shape.
+ * @return The slot index, or -1 if the shape has no such field.
+ */
+i64 shape_lookup(struct shape *shape, const struct obj_string *key);
+
+void shapes_mark(void);
+void shapes_promote(void);
+void shapes_free(void);
+
+#endif // CLOX__SHAPE_H_
@@ -0,0 +1,270 @@
+// For MAP_ANONYMOUS.
+#define _DEFAULT_SOURCE
+
+#include "slab.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// Free slots stay poisoned under AddressSanitizer, so that using an object
+// after it was swept is still caught. Pages are mapped, so the leak checker
+// has to be told to look for pointers in them.
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/lsan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#define __lsan_register_root_region(addr, size) ((void)(addr), (void)(size))
+#define __lsan_unregister_root_region(addr, size) ((void)(addr), (void)(size))
+#endif
+
+#define SLAB_ROUND(size) \
+    (((size) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1))
+#define SLAB_FIRST_SLOT SLAB_ROUND(sizeof(struct slab_page))
+
+void slab_heap_init(struct slab_heap *heap)
+{
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        heap->classes[i] = (struct slab_class){0};
+    }
+    heap->large = NULL;
+}
+
+void slab_heap_free(struct slab_heap *heap)
+{
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        slab_pages_release(heap->classes[i].pages);
+    }
+
+    struct slab_large *large = heap->large;
+    while (large) {
+        struct slab_large *next = large->next;
+        free(large);
+        large = next;
+    }
+    slab_heap_init(heap);
+}
+
+size_t slab_page_slots(size_t slot_size)
+{
+    return (SLAB_PAGE_SIZE - SLAB_FIRST_SLOT) / slot_size;
+}
+
+// Pages are mapped rather than taken from malloc(), so that releasing one
+// gives its memory back to the system. The mapping is made larger than a
+// page and trimmed down to an aligned one.
+static struct slab_page *map_page(void)
+{
+    u8 *memory = mmap(NULL, 2 * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        exit(1);
+
+    u8 *page = (u8 *)(((uintptr_t)memory + SLAB_PAGE_SIZE - 1) &
+                      ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    const size_t before = (size_t)(page - memory);
+    if (before > 0)
+        munmap(memory, before);
+    munmap(page + SLAB_PAGE_SIZE, SLAB_PAGE_SIZE - before);
+    __lsan_register_root_region(page, SLAB_PAGE_SIZE);
+    return (struct slab_page *)page;
+}
+
+void slab_pages_release(struct slab_page *page)
+{
+    while (page) {
+        struct slab_page *next = page->next;
+        ASAN_UNPOISON_MEMORY_REGION(page, SLAB_PAGE_SIZE);
+        __lsan_unregister_root_region(page, SLAB_PAGE_SIZE);
+        munmap(page, SLAB_PAGE_SIZE);
+        page = next;
+    }
+}
+
+// Fresh mappings are zeroed, which leaves the bitmaps clear.
+static void add_page(struct slab_class *class, size_t slot_size)
+{
+    struct slab_page *page = map_page();
+    page->next = class->pages;
+    page->slot_size = slot_size;
+    page->unswept = false;
+    class->pages = page;
+    class->page_count++;
+
+    class->top = (u8 *)page + SLAB_FIRST_SLOT;
+    class->end = (u8 *)page + SLAB_PAGE_SIZE;
+    ASAN_POISON_MEMORY_REGION(class->top, (size_t)(class->end - class->top));
+}
+
+static void *large_alloc(struct slab_heap *heap, size_t size)
+{
+    struct slab_large *large = malloc(sizeof(struct slab_large) + size);
+    if (!large)
+        exit(1);
+
+    large->prev = NULL;
+    large->next = heap->large;
+    large->unswept = false;
+    large->marks = 0;
+    if (heap->large)
+        heap->large->prev = large;
+    heap->large = large;
+    return large + 1;
+}
+
+static void large_release(struct slab_heap *heap, struct slab_large *large)
+{
+    if (large->prev)
+        large->prev->next = large->next;
+    else
+        heap->large = large->next;
+    if (large->next)
+        large->next->prev = large->prev;
+    free(large);
+}
+
+static size_t granule_index(const struct slab_page *page, const void *block)
+{
+    return (size_t)((const u8 *)block - (const u8 *)page) / SLAB_GRANULE;
+}
+
+static bool is_live(const struct slab_page *page, const void *block)
+{
+    const size_t index = granule_index(page, block);
+    return page->live[index / 64] & (u64)1 << (index % 64);
+}
+
+// Flip the live bit of the block, which is set while it is allocated.
+static void toggle_live(void *block)
+{
+    struct slab_page *page = slab_page_of(block);
+    const size_t index = granule_index(page, block);
+    page->live[index / 64] ^= (u64)1 << (index % 64);
+}
+
+static void push_free(struct slab_class *class, void *block, size_t size)
+{
+    struct slab_slot *slot = block;
+    ASAN_UNPOISON_MEMORY_REGION(slot, sizeof(struct slab_slot));
+    slot->next = class->free;
+    class->free = slot;
+    ASAN_POISON_MEMORY_REGION(slot, size);
+}
+
+void *slab_alloc(struct slab_heap *heap, size_t size)
+{
+    if (size > SLAB_MAX_SIZE)
+        return large_alloc(heap, size);
+
+    struct slab_class *class = slab_class_of(heap, size);
+    class->live++;
+    struct slab_slot *slot = class->free;
+    if (slot) {
+        ASAN_UNPOISON_MEMORY_REGION(slot, size);
+        class->free = slot->next;
+        toggle_live(slot);
+        return slot;
+    }
+
+    const size_t slot_size = SLAB_ROUND(size);
+    if ((size_t)(class->end - class->top) < slot_size)
+        add_page(class, slot_size);
+
+    void *block = class->top;
+    class->top += slot_size;
+    ASAN_UNPOISON_MEMORY_REGION(block, size);
+    toggle_live(block);
+    return block;
+}
+
+void slab_release(struct slab_heap *heap, void *block, size_t size)
+{
+    if (size > SLAB_MAX_SIZE) {
+        large_release(heap, slab_large_of(block));
+        return;
+    }
+
+    struct slab_class *class = slab_class_of(heap, size);
+    class->live--;
+    toggle_live(block);
+    push_free(class, block, SLAB_ROUND(size));
+}
+
+static size_t page_live(const struct slab_page *page)
+{
+    size_t live = 0;
+    for (size_t i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        live += (size_t)__builtin_popcountll(page->live[i]);
+    }
+    return live;
+}
+
+struct page_order {
+    struct slab_page *page;
+    size_t live;
+};
+
+static int compare_fullest_first(const void *a, const void *b)
+{
+    const size_t live_a = ((const struct page_order *)a)->live;
+    const size_t live_b = ((const struct page_order *)b)->live;
+    return (live_a < live_b) - (live_a > live_b);
+}
+
+struct slab_page *slab_evacuate(struct slab_class *class)
+{
+    if (!class->pages)
+        return NULL;
+
+    const size_t slot_size = class->pages->slot_size;
+    const size_t slots = slab_page_slots(slot_size);
+    const size_t keep = (class->live + slots - 1) / slots;
+    if (keep >= class->page_count)
+        return NULL;
+
+    struct page_order *order =
+        malloc(sizeof(struct page_order) * class->page_count);
+    if (!order)
+        exit(1);
+
+    size_t count = 0;
+    for (struct slab_page *page = class->pages; page; page = page->next) {
+        order[count++] = (struct page_order){page, page_live(page)};
+    }
+    qsort(order, count, sizeof(struct page_order), compare_fullest_first);
+
+    // Only the newest page is still being handed out, and the slots past
+    // top are not on the free list.
+    const struct slab_page *newest =
+        class->top ? slab_page_of(class->top - 1) : NULL;
+    struct slab_page *evacuated = NULL;
+    class->pages = NULL;
+    class->free = NULL;
+    class->page_count = keep;
+
+    for (size_t i = count; i-- > 0;) {
+        struct slab_page *page = order[i].page;
+        if (i >= keep) {
+            class->live -= order[i].live;
+            page->next = evacuated;
+            evacuated = page;
+            if (page == newest)
+                class->top = class->end = NULL;
+            continue;
+        }
+
+        page->next = class->pages;
+        class->pages = page;
+        const u8 *end =
+            page == newest ? class->top : (const u8 *)page + SLAB_PAGE_SIZE;
+        for (u8 *slot = (u8 *)page + SLAB_FIRST_SLOT; slot + slot_size <= end;
+             slot += slot_size) {
+            if (!is_live(page, slot))
+                push_free(class, slot, slot_size);
+        }
+    }
+
+    free(order);
+    return evacuated;
+}
@@ -0,0 +1,154 @@
+#ifndef CLOX__SLAB_H_
+#define CLOX__SLAB_H_
+
+#include "common.h"
+
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_GRANULE 8
+// Larger blocks get a malloc() of their own.
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_SIZE / SLAB_GRANULE / 64)
+
+/**
+ * A page holds slots of a single size, which follow the header. Pages are
+ * aligned to SLAB_PAGE_SIZE, so the page of a block is found by masking its
+ * address.
+ */
+struct slab_page {
+    struct slab_page *next;
+    size_t slot_size;
+    // Whether the major collection in progress has yet to sweep the page.
+    bool unswept;
+    // One bit for each granule of the page, set in live where an allocated
+    // block starts and in marks where a block marked by the collector starts.
+    u64 live[SLAB_BITMAP_WORDS];
+    u64 marks[SLAB_BITMAP_WORDS];
+};
+
+/**
+ * The header of a block too large for the slabs, which gets a malloc() of
+ * its own.
+ */
+struct slab_large {
+    struct slab_large *prev;
+    struct slab_large *next;
+    bool unswept;
+    u64 marks;
+};
+
+struct slab_slot {
+    struct slab_slot *next;
+};
+
+struct slab_class {
+    // Slots given back by slab_release().
+    struct slab_slot *free;
+    // The part of the newest page that was never handed out.
+    u8 *top;
+    u8 *end;
+    // Every page of the class, and the number of blocks allocated in them.
+    struct slab_page *pages;
+    size_t page_count;
+    size_t live;
+    // The next of the pages the major collection in progress has to sweep,
+    // which continue up to the end of the list.
+    struct slab_page *sweep;
+};
+
+/**
+ * Memory for blocks of fixed size, such as objects. Small ones are carved
+ * out of pages shared by blocks of the same size class.
+ */
+struct slab_heap {
+    struct slab_class classes[SLAB_CLASS_COUNT];
+    struct slab_large *large;
+};
+
+void slab_heap_init(struct slab_heap *heap);
+
+/**
+ * Release every page and large block of the heap, whether or not its blocks
+ * were released.
+ */
+void slab_heap_free(struct slab_heap *heap);
+
+/**
+ * Allocate a block of size bytes, aligned to SLAB_GRANULE. Exits the program
+ * when out of memory, like reallocate().
+ */
+void *slab_alloc(struct slab_heap *heap, size_t size);
+
+/**
+ * Give a block back to the heap. size must be the one it was allocated with.
+ */
+void slab_release(struct slab_heap *heap, void *block, size_t size);
+
+/**
+ * Count the slots of a page that holds blocks of slot_size bytes.
+ */
+size_t slab_page_slots(size_t slot_size);
+
+/**
+ * Pick pages of the class to empty, the least full ones whose blocks fit in
+ * the free slots of the others. The class forgets them and only hands out
+ * slots of the pages it keeps from then on, so the caller can move the
+ * blocks still allocated in them with slab_alloc().
+ * @return The pages picked, linked through next, or NULL if none of the
+ *         class's pages would end up empty.
+ */
+struct slab_page *slab_evacuate(struct slab_class *class);
+
+/**
+ * Give a list of pages linked through next back to the system.
+ */
+void slab_pages_release(struct slab_page *pages);
+
+/**
+ * Get the size class of blocks of size bytes, which must not be larger than
+ * SLAB_MAX_SIZE.
+ */
+static inline struct slab_class *slab_class_of(struct slab_heap *heap,
+                                               size_t size)
+{
+    return &heap->classes[(size + SLAB_GRANULE - 1) / SLAB_GRANULE - 1];
+}
+
+static inline struct slab_page *slab_page_of(const void *block)
+{
+    return (struct slab_page *)((uintptr_t)block &
+                                ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static inline struct slab_large *slab_large_of(const void *block)
+{
+    return (struct slab_large *)block - 1;
+}
+
+/**
+ * Find the mark bit of a block of size bytes.
+ * @param[out] bit The bit within the word.
+ * @return The word holding the bit.
+ */
+static inline u64 *slab_mark_word(const void *block, size_t size, u64 *bit)
+{
+    if (size > SLAB_MAX_SIZE) {
+        *bit = 1;
+        return &slab_large_of(block)->marks;
+    }
+
+    struct slab_page *page = slab_page_of(block);
+    const size_t index =
+        (size_t)((const u8 *)block - (const u8 *)page) / SLAB_GRANULE;
+    *bit = (u64)1 << (index % 64);
+    return &page->marks[index / 64];
+}
+
+static inline bool slab_is_unswept(const void *block, size_t size)
+{
+    if (size > SLAB_MAX_SIZE)
+        return slab_large_of(block)->unswept;
+    return slab_page_of(block)->unswept;
+}
+
+#endif // CLOX__SLAB_H_
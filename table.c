@@ -5,89 +5,205 @@
 #include "value.h"
 #include <string.h>
 
-#define TABLE_MAX_LOAD 0.75
+#if defined(SIMD_TABLE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+// Slots are probed a group at a time, and a table has a whole number of
+// groups.
+#define TABLE_GROUP_SIZE 16
+
+// The control byte of a slot without a key has the high bit set, and that of
+// a full slot holds the low seven bits of its key's hash.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+// How many slots may be filled before the table is rebuilt.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
 
 void table_init(struct table *t)
 {
     t->len = 0;
     t->capacity = 0;
+    t->growth_left = 0;
+    t->control = NULL;
     t->entries = NULL;
 }
 
 void table_free(struct table *t)
 {
+    FREE_ARRAY(u8, t->control, t->capacity);
     FREE_ARRAY(struct entry, t->entries, t->capacity);
     table_init(t);
 }
 
-static struct entry *find_entry(struct entry *entries, size_t capacity,
-                                const struct obj_string *key)
-{
-    size_t index = key->hash & (capacity - 1);
-    struct entry *tombstone = NULL;
-
-    for (;;) {
-        struct entry *entry = &entries[index];
-        if (!entry->key) {
-            if (IS_NIL(entry->value)) {
-                // bucket is empty
-                return tombstone ? tombstone : entry;
-            }
-            if (!tombstone) {
-                // bucket had a tombstone
-                tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // found the key
-            return entry;
+static u8 hash_tag(u32 hash)
+{
+    return (u8)(hash & 0x7f);
+}
+
+// The remaining bits of the hash pick the group the probe starts at.
+static size_t probe_start(const struct table *table, u32 hash)
+{
+    return ((size_t)(hash >> 7) * TABLE_GROUP_SIZE) & (table->capacity - 1);
+}
+
+#ifdef TABLE_SSE2
+static u32 group_match(const u8 *group, u8 control)
+{
+    const __m128i bytes = _mm_loadu_si128((const __m128i *)group);
+    return (u32)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control)));
+}
+
+static u32 group_match_free(const u8 *group)
+{
+    return (u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+#else
+// Without SSE2 a group is read as two words, and the bytes of a word are
+// compared at once with arithmetic on the whole word.
+#define BYTES_LOW 0x0101010101010101u
+#define BYTES_HIGH 0x8080808080808080u
+
+static u64 load_word(const u8 *bytes)
+{
+    u64 word;
+    memcpy(&word, bytes, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Gather the high bit of each byte of the word into the low eight bits.
+static u32 gather(u64 high_bits)
+{
+    return (u32)(((high_bits >> 7) * 0x0102040810204080u) >> 56);
+}
+
+// A byte that follows a matching one may be reported as matching too, which
+// the callers are fine with: there is a match either way, and the key of a
+// full slot is compared before it is used.
+static u32 word_match(u64 word, u8 control)
+{
+    const u64 x = word ^ (BYTES_LOW * control);
+    return gather((x - BYTES_LOW) & ~x & BYTES_HIGH);
+}
+
+static u32 group_match(const u8 *group, u8 control)
+{
+    return word_match(load_word(group), control) |
+           word_match(load_word(group + 8), control) << 8;
+}
+
+static u32 group_match_free(const u8 *group)
+{
+    return gather(load_word(group) & BYTES_HIGH) |
+           gather(load_word(group + 8) & BYTES_HIGH) << 8;
+}
+#endif
+
+// Find the slot holding the key. The probe visits every group, so it ends at
+// the first group with an empty slot, which there always is.
+// Returns the capacity if the key is not in the table.
+static size_t find_slot(const struct table *table,
+                        const struct obj_string *key)
+{
+    const size_t mask = table->capacity - 1;
+    const u8 tag = hash_tag(key->hash);
+    size_t group = probe_start(table, key->hash);
+    for (size_t step = TABLE_GROUP_SIZE;; step += TABLE_GROUP_SIZE) {
+        const u8 *control = &table->control[group];
+        for (u32 match = group_match(control, tag); match;
+             match &= match - 1) {
+            const size_t index = group + (size_t)__builtin_ctz(match);
+            if (table->entries[index].key == key)
+                return index;
         }
+        if (group_match(control, CONTROL_EMPTY))
+            return table->capacity;
+        group = (group + step) & mask;
+    }
+}
 
-        // probe linearly if the bucket is occupied
-        index = (index + 1) & (capacity - 1);
+// Find the first empty or deleted slot on the probe of the hash.
+static size_t find_free_slot(const struct table *table, u32 hash)
+{
+    const size_t mask = table->capacity - 1;
+    size_t group = probe_start(table, hash);
+    for (size_t step = TABLE_GROUP_SIZE;; step += TABLE_GROUP_SIZE) {
+        const u32 match = group_match_free(&table->control[group]);
+        if (match)
+            return group + (size_t)__builtin_ctz(match);
+        group = (group + step) & mask;
     }
 }
 
-static void adjust_capacity(struct table *table, size_t capacity)
+static void put(struct table *table, size_t index, struct obj_string *key,
+                value_ty value)
 {
+    table->control[index] = hash_tag(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+}
+
+// Move the entries to new arrays. They are made larger unless enough of the
+// filled slots were deleted that clearing them leaves room to grow.
+static void rebuild(struct table *table)
+{
+    size_t capacity = table->capacity;
+    if (table->len >= TABLE_MAX_LOAD(capacity) / 4 * 3)
+        capacity = capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE
+                                               : capacity * 2;
+
+    u8 *control = ALLOCATE(u8, capacity);
     struct entry *entries = ALLOCATE(struct entry, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
     for (size_t i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
 
-    table->len = 0;
-    for (size_t i = 0; i < table->capacity; i++) {
-        const struct entry *entry = &table->entries[i];
-        if (!entry->key)
-            continue;
-
-        struct entry *dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->len++;
-    }
-
-    FREE_ARRAY(struct entry, table->entries, table->capacity);
-    table->entries = entries;
+    struct table old = *table;
     table->capacity = capacity;
+    table->growth_left = TABLE_MAX_LOAD(capacity) - table->len;
+    table->control = control;
+    table->entries = entries;
+    for (size_t i = 0; i < old.capacity; i++) {
+        const struct entry *entry = &old.entries[i];
+        if (entry->key)
+            put(table, find_free_slot(table, entry->key->hash), entry->key,
+                entry->value);
+    }
+    table_free(&old);
 }
 
 bool table_set(struct table *table, struct obj_string *key, value_ty value)
 {
-    if (((f64)(table->len + 1)) > ((f64)table->capacity * TABLE_MAX_LOAD)) {
-        const size_t capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+    if (table->len > 0) {
+        const size_t index = find_slot(table, key);
+        if (index < table->capacity) {
+            table->entries[index].value = value;
+            return false;
+        }
     }
 
-    struct entry *entry = find_entry(table->entries, table->capacity, key);
-    const bool is_new_key = !entry->key;
-
-    if (is_new_key && IS_NIL(entry->value))
-        table->len++;
+    // A deleted slot can be reused as is, but filling an empty one takes
+    // room to grow.
+    size_t index = table->capacity ? find_free_slot(table, key->hash) : 0;
+    if (table->capacity == 0 ||
+        (table->control[index] == CONTROL_EMPTY && table->growth_left == 0)) {
+        rebuild(table);
+        index = find_free_slot(table, key->hash);
+    }
+    if (table->control[index] == CONTROL_EMPTY)
+        table->growth_left--;
 
-    entry->key = key;
-    entry->value = value;
-    return is_new_key;
+    put(table, index, key, value);
+    table->len++;
+    return true;
 }
 
 bool table_get(const struct table *table, const struct obj_string *key,
@@ -96,31 +212,39 @@ bool table_get(const struct table *table, const struct obj_string *key,
     if (table->len == 0)
         return false;
 
-    const struct entry *entry =
-        find_entry(table->entries, table->capacity, key);
-    if (!entry->key)
+    const size_t index = find_slot(table, key);
+    if (index == table->capacity)
         return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
-bool table_delete(const struct table *table, const struct obj_string *key)
+bool table_delete(struct table *table, const struct obj_string *key)
 {
     if (table->len == 0)
         return false;
 
-    // find the entry
-    struct entry *entry = find_entry(table->entries, table->capacity, key);
-    if (!entry->key)
+    const size_t index = find_slot(table, key);
+    if (index == table->capacity)
         return false;
 
-    // place a tombstone in the entry
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // A group only overflows into the next while it has no empty slot, and
+    // then never gets one back until the table is rebuilt. If the group still
+    // has one, no probe goes past it, and the slot can be emptied rather
+    // than marked deleted.
+    const size_t group = index & ~(size_t)(TABLE_GROUP_SIZE - 1);
+    if (group_match(&table->control[group], CONTROL_EMPTY)) {
+        table->control[index] = CONTROL_EMPTY;
+        table->growth_left++;
+    } else {
+        table->control[index] = CONTROL_DELETED;
+    }
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->len--;
     return true;
 }
-
 void table_add_all(const struct table *source, struct table *dest)
 {
     for (size_t i = 0; i < source->capacity; i++) {
@@ -130,49 +254,21 @@ void table_add_all(const struct table *source, struct table *dest)
     }
 }
 
-const struct obj_string *table_find_string(const struct table *table,
-                                           const char *chars, size_t length,
-                                           u32 hash)
-{
-    if (table->len == 0)
-        return NULL;
-
-    size_t index = hash & (table->capacity - 1);
-    for (;;) {
-        const struct entry *entry = &table->entries[index];
-
-        if (!entry->key) {
-            // stop if we find an empty non-tombstone entry
-            if (IS_NIL(entry->value))
-                return NULL;
-
-        } else if ((entry->key->length == length) &&
-                   (entry->key->hash == hash) &&
-                   (memcmp(entry->key->chars, chars, length) == 0)) {
-            // found the entry
-            return entry->key;
-        }
-
-        // probe linearly if the bucket is occupied
-        index = (index + 1) & (table->capacity - 1);
-    }
-}
-
-void table_remove_unreachable(const struct table *table)
+void table_mark(const struct table *table)
 {
     for (size_t i = 0; i < table->capacity; i++) {
         const struct entry *entry = &table->entries[i];
-        if (entry->key && !entry->key->obj.is_marked) {
-            table_delete(table, entry->key);
-        }
+        object_mark((struct obj *)entry->key);
+        value_mark(entry->value);
     }
 }
 
-void table_mark(const struct table *table)
+void table_promote(const struct table *table)
 {
     for (size_t i = 0; i < table->capacity; i++) {
-        const struct entry *entry = &table->entries[i];
-        object_mark((struct obj *)entry->key);
-        value_mark(entry->value);
+        struct entry *entry = &table->entries[i];
+        entry->key =
+            (struct obj_string *)object_promote((struct obj *)entry->key);
+        value_promote(&entry->value);
     }
 }
@@ -9,9 +9,19 @@ struct entry {
     value_ty value;
 };
 
+/**
+ * A hash table keyed by interned strings, in the manner of a Swiss table.
+ * Each slot has a control byte, which tells whether the slot is empty,
+ * deleted, or holds a key, along with seven bits of the key's hash. A probe
+ * compares a whole group of control bytes at once and only reads the entries
+ * whose bits match. The key of an empty or deleted entry is NULL.
+ */
 struct table {
     size_t len;
     size_t capacity;
+    // How many more empty slots may be filled before the table is rebuilt.
+    size_t growth_left;
+    u8 *control;
     struct entry *entries;
 };
 
@@ -20,13 +30,9 @@ void table_free(struct table *t);
 bool table_set(struct table *table, struct obj_string *key, value_ty value);
 bool table_get(const struct table *table, const struct obj_string *key,
                value_ty *value);
-bool table_delete(const struct table *table, const struct obj_string *key);
+bool table_delete(struct table *table, const struct obj_string *key);
 void table_add_all(const struct table *source, struct table *dest);
-const struct obj_string *table_find_string(const struct table *table,
-                                           const char *chars, size_t length,
-                                           u32 hash);
-
-void table_remove_unreachable(const struct table *table);
 void table_mark(const struct table *table);
+void table_promote(const struct table *table);
 
 #endif // CLOX__TABLE_H_
@@ -0,0 +1,49 @@
+# Compile and run a function whose frame has COUNT slots, slot zero included,
+# called from inside another function. At the limit of 65536 it has to run,
+# above it the compiler has to reject it.
+#
+#   cmake -DCLOX=<clox> -DCOUNT=<slots> -DWORK_DIR=<dir> -P locals_limit.cmake
+#
+# The locals are spread over nested blocks of 256, as the check for a name
+# declared twice in one scope is linear in the size of the scope.
+
+set(script "${WORK_DIR}/locals_${COUNT}.lox")
+math(EXPR last "${COUNT} - 2")
+math(EXPR blocks "(${last} + 256) / 256")
+
+file(WRITE "${script}" "fun f() {\n")
+set(index 0)
+foreach(block RANGE 1 ${blocks})
+  set(text "{\n")
+  foreach(i RANGE 1 256)
+    if(index GREATER last)
+      break()
+    endif()
+    string(APPEND text "var v${index};\n")
+    math(EXPR index "${index} + 1")
+  endforeach()
+  file(APPEND "${script}" "${text}")
+endforeach()
+file(APPEND "${script}" "v0 = 1;\nv${last} = 2;\nreturn v0 + v${last};\n")
+foreach(block RANGE 1 ${blocks})
+  file(APPEND "${script}" "}\n")
+endforeach()
+file(APPEND "${script}"
+     "}\nfun g() {\nvar a = 1;\nvar b = 2;\nreturn f() + a + b;\n}\nprint g();\n")
+
+execute_process(
+  COMMAND "${CLOX}" "${script}"
+  RESULT_VARIABLE result
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE error)
+
+if(COUNT LESS_EQUAL 65536)
+  if(NOT result EQUAL 0 OR NOT output STREQUAL "6\n")
+    message(FATAL_ERROR "Expected 6 with ${COUNT} slots, got ${result}: "
+                        "${output}${error}")
+  endif()
+elseif(NOT result EQUAL 65
+       OR NOT error MATCHES "Too many local variables in function")
+  message(FATAL_ERROR "Expected a compile error with ${COUNT} slots, got "
+                      "${result}: ${output}${error}")
+endif()
@@ -0,0 +1,316 @@
+// Tests of struct table. The seven lowest bits of a key's hash are its tag,
+// and the bits above them pick the group its probe starts at, so keys made
+// with group_hash() can be put in a group of our choosing.
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <stdlib.h>
+
+// As in table.c.
+#define GROUP_SIZE 16
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+#define MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+static i32 failures = 0;
+
+#define CHECK(condition)                                                    \
+    do {                                                                    \
+        if (!(condition)) {                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #condition);                                            \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+// The table only reads the hash of a key and compares keys by address, so
+// the keys are made outside the collector's heap.
+static struct obj_string *make_key(u32 hash)
+{
+    struct obj_string *key = calloc(1, sizeof(struct obj_string) + 1);
+    if (!key)
+        exit(1);
+    key->obj.type = OBJ_STRING;
+    key->hash = hash;
+    return key;
+}
+
+static void free_keys(struct obj_string **keys, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        free(keys[i]);
+    }
+}
+
+// A hash whose probe starts at the group, in a table with more groups than
+// that.
+static u32 group_hash(u32 group, u32 tag)
+{
+    return group << 7 | tag;
+}
+
+static u64 random_next(u64 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static size_t slot_of(const struct table *table, const struct obj_string *key)
+{
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key == key)
+            return i;
+    }
+    return table->capacity;
+}
+
+static bool has_value(const struct table *table, const struct obj_string *key,
+                      f64 expected)
+{
+    value_ty value;
+    return table_get(table, key, &value) && IS_NUMBER(value) &&
+           AS_NUMBER(value) == expected;
+}
+
+static size_t count_control(const struct table *table, u8 control)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->control[i] == control)
+            count++;
+    }
+    return count;
+}
+
+static void test_set_get_delete(void)
+{
+    enum { KEY_COUNT = 5000 };
+    struct obj_string *keys[KEY_COUNT];
+    u64 state = 0x9e3779b97f4a7c15u;
+    for (size_t i = 0; i < KEY_COUNT; i++) {
+        keys[i] = make_key((u32)random_next(&state));
+    }
+
+    struct table table;
+    table_init(&table);
+    for (size_t i = 0; i < KEY_COUNT; i++) {
+        CHECK(table_set(&table, keys[i], NUMBER_VAL((f64)i)));
+    }
+    CHECK(table.len == KEY_COUNT);
+    CHECK(table.capacity == 8192);
+    for (size_t i = 0; i < KEY_COUNT; i++) {
+        CHECK(!table_set(&table, keys[i], NUMBER_VAL((f64)i + 0.5)));
+    }
+    CHECK(table.len == KEY_COUNT);
+
+    struct table copy;
+    table_init(&copy);
+    table_add_all(&table, &copy);
+    CHECK(copy.len == KEY_COUNT);
+
+    for (size_t i = 0; i < KEY_COUNT; i += 2) {
+        CHECK(table_delete(&table, keys[i]));
+        CHECK(!table_delete(&table, keys[i]));
+    }
+    CHECK(table.len == KEY_COUNT / 2);
+    for (size_t i = 0; i < KEY_COUNT; i++) {
+        value_ty value;
+        if (i % 2 == 0)
+            CHECK(!table_get(&table, keys[i], &value));
+        else
+            CHECK(has_value(&table, keys[i], (f64)i + 0.5));
+        CHECK(has_value(&copy, keys[i], (f64)i + 0.5));
+    }
+
+    table_free(&table);
+    table_free(&copy);
+    free_keys(keys, KEY_COUNT);
+}
+
+// A slot deleted from a full group has to stay deleted, as probes for the
+// keys that overflowed the group go on past it. It is filled again by the
+// next key whose probe reaches it.
+static void test_deleted_slots(void)
+{
+    struct obj_string *keys[GROUP_SIZE + 2];
+    for (u32 i = 0; i < GROUP_SIZE + 2; i++) {
+        keys[i] = make_key(group_hash(0, i));
+    }
+
+    struct table table;
+    table_init(&table);
+    for (size_t i = 0; i <= GROUP_SIZE; i++) {
+        table_set(&table, keys[i], NUMBER_VAL((f64)i));
+    }
+    CHECK(table.capacity == 2 * GROUP_SIZE);
+    struct obj_string *overflow = keys[GROUP_SIZE];
+    CHECK(slot_of(&table, overflow) >= GROUP_SIZE);
+
+    size_t growth_left = table.growth_left;
+    const size_t deleted = slot_of(&table, keys[3]);
+    CHECK(table_delete(&table, keys[3]));
+    CHECK(table.control[deleted] == CONTROL_DELETED);
+    CHECK(table.entries[deleted].key == NULL);
+    CHECK(table.growth_left == growth_left);
+    CHECK(has_value(&table, overflow, GROUP_SIZE));
+
+    // The group the overflow went to still has empty slots.
+    const size_t emptied = slot_of(&table, overflow);
+    CHECK(table_delete(&table, overflow));
+    CHECK(table.control[emptied] == CONTROL_EMPTY);
+    CHECK(table.growth_left == growth_left + 1);
+
+    struct obj_string *reused = keys[GROUP_SIZE + 1];
+    CHECK(table_set(&table, reused, NUMBER_VAL(-1.0)));
+    CHECK(slot_of(&table, reused) == deleted);
+    CHECK(table.growth_left == growth_left + 1);
+    CHECK(count_control(&table, CONTROL_DELETED) == 0);
+    for (size_t i = 0; i < GROUP_SIZE; i++) {
+        if (i != 3)
+            CHECK(has_value(&table, keys[i], (f64)i));
+    }
+
+    table_free(&table);
+    free_keys(keys, GROUP_SIZE + 2);
+}
+
+// A table that runs out of empty slots while many of its slots are deleted
+// is rebuilt at the same capacity.
+static void test_rebuild_in_place(void)
+{
+    enum { FIRST = 16, SECOND = 12, KEY_COUNT = FIRST + SECOND + 1 };
+    struct obj_string *keys[KEY_COUNT];
+    for (u32 i = 0; i < KEY_COUNT; i++) {
+        keys[i] = make_key(group_hash(i < FIRST ? 0 : 1, i));
+    }
+
+    struct table table;
+    table_init(&table);
+    for (size_t i = 0; i < FIRST + SECOND; i++) {
+        table_set(&table, keys[i], NUMBER_VAL((f64)i));
+    }
+    CHECK(table.capacity == 2 * GROUP_SIZE);
+    CHECK(table.growth_left == 0);
+
+    for (size_t i = 0; i < SECOND; i++) {
+        CHECK(table_delete(&table, keys[i]));
+    }
+    CHECK(count_control(&table, CONTROL_DELETED) == SECOND);
+    CHECK(table.growth_left == 0);
+
+    CHECK(table_set(&table, keys[KEY_COUNT - 1], NUMBER_VAL(-1.0)));
+    CHECK(table.capacity == 2 * GROUP_SIZE);
+    CHECK(table.len == FIRST + 1);
+    CHECK(table.growth_left == MAX_LOAD(table.capacity) - table.len);
+    CHECK(count_control(&table, CONTROL_DELETED) == 0);
+    for (size_t i = 0; i < FIRST + SECOND; i++) {
+        value_ty value;
+        if (i < SECOND)
+            CHECK(!table_get(&table, keys[i], &value));
+        else
+            CHECK(has_value(&table, keys[i], (f64)i));
+    }
+    CHECK(has_value(&table, keys[KEY_COUNT - 1], -1.0));
+
+    table_free(&table);
+    free_keys(keys, KEY_COUNT);
+}
+
+struct churn {
+    struct table table;
+    struct obj_string **keys;
+    // Indices of the keys in the table, and of those not in it.
+    size_t *live;
+    size_t live_count;
+    size_t *dead;
+    size_t dead_count;
+    u64 state;
+};
+
+// Delete a random key in the table and insert a random one not in it.
+static void churn_keys(struct churn *churn, size_t rounds)
+{
+    for (size_t round = 0; round < rounds; round++) {
+        const size_t i = random_next(&churn->state) % churn->live_count;
+        const size_t j = random_next(&churn->state) % churn->dead_count;
+        const size_t added = churn->dead[j];
+        CHECK(table_delete(&churn->table, churn->keys[churn->live[i]]));
+        CHECK(table_set(&churn->table, churn->keys[added],
+                        NUMBER_VAL((f64)added)));
+        churn->dead[j] = churn->live[i];
+        churn->live[i] = added;
+    }
+}
+
+// Deleting a key and inserting another over and over does not grow the table
+// while the keys fill less than 3/4 of its maximum load, since the rebuilds
+// that clear its deleted slots then keep its capacity. Above that it grows
+// once, and no more.
+static void test_churn(size_t live_count, bool grows)
+{
+    enum { KEY_COUNT = 1400, ROUNDS = 100000 };
+    struct obj_string *keys[KEY_COUNT];
+    size_t live[KEY_COUNT];
+    size_t dead[KEY_COUNT];
+    struct churn churn = {.keys = keys,
+                          .live = live,
+                          .live_count = live_count,
+                          .dead = dead,
+                          .dead_count = KEY_COUNT - live_count,
+                          .state = 0x2545f4914f6cdd1du};
+    for (size_t i = 0; i < KEY_COUNT; i++) {
+        keys[i] = make_key((u32)random_next(&churn.state));
+    }
+
+    table_init(&churn.table);
+    for (size_t i = 0; i < live_count; i++) {
+        table_set(&churn.table, keys[i], NUMBER_VAL((f64)i));
+        live[i] = i;
+    }
+    for (size_t i = 0; i < churn.dead_count; i++) {
+        dead[i] = live_count + i;
+    }
+    const size_t capacity = churn.table.capacity;
+
+    churn_keys(&churn, ROUNDS);
+    const size_t churned_capacity = churn.table.capacity;
+    CHECK(churned_capacity == (grows ? 2 * capacity : capacity));
+    churn_keys(&churn, ROUNDS);
+    CHECK(churn.table.capacity == churned_capacity);
+    CHECK(churn.table.len == live_count);
+
+    for (size_t i = 0; i < churn.live_count; i++) {
+        CHECK(has_value(&churn.table, keys[live[i]], (f64)live[i]));
+    }
+    for (size_t i = 0; i < churn.dead_count; i++) {
+        value_ty value;
+        CHECK(!table_get(&churn.table, keys[dead[i]], &value));
+    }
+
+    table_free(&churn.table);
+    free_keys(keys, KEY_COUNT);
+}
+
+i32 main(void)
+{
+    // The tables allocate through the collector, which has to be set up.
+    vm_init();
+    test_set_get_delete();
+    test_deleted_slots();
+    test_rebuild_in_place();
+    // 1024 slots, of which 896 may be filled before a rebuild, which keeps
+    // the capacity for up to 672 keys.
+    test_churn(600, false);
+    test_churn(700, true);
+    vm_free();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed.\n", failures);
+        return 1;
+    }
+    return 0;
+}
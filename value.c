@@ -2,7 +2,6 @@
 
 #include "memory.h"
 #include "object.h"
-#include <math.h>
 #include <string.h>
 
 void value_array_init(struct value_array *array)
@@ -56,17 +55,36 @@ void value_print(value_ty v)
     case VAL_OBJ:
         object_print(v);
         break;
+    case VAL_UNDEFINED:
+        break;
     }
 #endif
 }
 
+// Strings are interned, so they are equal only if they are the same object,
+// while a rope is equal to the string it flattens into.
+static bool texts_equal(value_ty a, value_ty b)
+{
+    if (!(IS_ROPE(a) || IS_ROPE(b)) || !is_text(a) || !is_text(b))
+        return false;
+    if (text_length(a) != text_length(b))
+        return false;
+    if (IS_ROPE(a))
+        a = OBJ_VAL(rope_flatten(AS_ROPE(a)));
+    if (IS_ROPE(b))
+        b = OBJ_VAL(rope_flatten(AS_ROPE(b)));
+    return AS_OBJ(a) == AS_OBJ(b);
+}
+
 bool values_equal(value_ty a, value_ty b)
 {
 #ifdef NAN_BOXING
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
-        return AS_NUMBER(a) == AS_NUMBER(b);
+        return numbers_equal(AS_NUMBER(a), AS_NUMBER(b));
     }
-    return a == b;
+    if (a == b)
+        return true;
+    return texts_equal(a, b);
 #else
 
     if (a.type != b.type) {
@@ -79,9 +97,9 @@ bool values_equal(value_ty a, value_ty b)
     case VAL_NIL:
         return true;
     case VAL_NUMBER:
-        return fabs(AS_NUMBER(a) - AS_NUMBER(b)) < DBL_EPSILON;
+        return numbers_equal(AS_NUMBER(a), AS_NUMBER(b));
     case VAL_OBJ:
-        return AS_OBJ(a) == AS_OBJ(b);
+        return AS_OBJ(a) == AS_OBJ(b) || texts_equal(a, b);
     default:
         return false;
     }
@@ -2,11 +2,15 @@
 #define CLOX__VALUE_H_
 
 #include "common.h"
+#include <math.h>
 #include <string.h>
 
 struct obj;
 struct obj_string;
 
+// UNDEFINED_VAL marks a global slot that has been resolved by the compiler
+// but not defined yet. It never reaches user code.
+
 #ifdef NAN_BOXING
 #define SIGN_BIT ((u64)0x8000000000000000)
 #define QNAN ((u64)0x7ffc000000000000)
@@ -14,6 +18,7 @@ struct obj_string;
 #define TAG_NIL 1 // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE 3 // 11
+#define TAG_UNDEFINED 4 // 100
 
 typedef u64 value_ty;
 
@@ -21,6 +26,7 @@ typedef u64 value_ty;
 #define IS_NIL(v) ((v) == NIL_VAL)
 #define IS_NUMBER(v) (((v)&QNAN) != QNAN)
 #define IS_OBJ(v) (((v) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(v) ((v) == UNDEFINED_VAL)
 
 #define AS_BOOL(v) ((v) == TRUE_VAL)
 #define AS_NUMBER(v) value_to_num(v)
@@ -30,6 +36,7 @@ typedef u64 value_ty;
 #define FALSE_VAL ((value_ty)(u64)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((value_ty)(u64)(QNAN | TAG_TRUE))
 #define NIL_VAL ((value_ty)(u64)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((value_ty)(u64)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) num_to_value(num)
 #define OBJ_VAL(obj) (value_ty)(SIGN_BIT | QNAN | (u64)(uintptr_t)(obj))
 
@@ -48,7 +55,7 @@ static inline value_ty num_to_value(double num)
 }
 
 #else
-enum value_type { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ };
+enum value_type { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ, VAL_UNDEFINED };
 
 struct value {
     enum value_type type;
@@ -65,6 +72,7 @@ typedef struct value value_ty;
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(v) ((v).type == VAL_NUMBER)
 #define IS_OBJ(v) ((v).type == VAL_OBJ)
+#define IS_UNDEFINED(v) ((v).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(v) ((v).as.number)
@@ -74,6 +82,7 @@ typedef struct value value_ty;
 #define NIL_VAL ((value_ty){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(v) ((value_ty){VAL_NUMBER, {.number = v}})
 #define OBJ_VAL(object) ((value_ty){VAL_OBJ, {.obj = (struct obj *)object}})
+#define UNDEFINED_VAL ((value_ty){VAL_UNDEFINED, {.number = 0}})
 #endif
 
 struct value_array {
@@ -82,6 +91,15 @@ struct value_array {
     value_ty *values;
 };
 
+static inline bool numbers_equal(f64 a, f64 b)
+{
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    return fabs(a - b) < DBL_EPSILON;
+#endif
+}
+
 bool values_equal(value_ty a, value_ty b);
 void value_array_init(struct value_array *array);
 void value_array_write(struct value_array *array, value_ty v);
@@ -10,11 +10,14 @@
 #endif
 #include "memory.h"
 #include "object.h"
+#include "shape.h"
 #include <string.h>
 #include <time.h>
 
 struct vm vm;
 
+#define PROPERTY_CACHE_MAX_MISSES 4
+
 static value_ty clock_native(i32 n_args, value_ty *args)
 {
     (void)n_args;
@@ -22,6 +25,78 @@ static value_ty clock_native(i32 n_args, value_ty *args)
     return NUMBER_VAL((f64)clock() / CLOCKS_PER_SEC);
 }
 
+static void set_stat(struct obj_instance *stats, const char *name,
+                     size_t value)
+{
+    push(OBJ_VAL(copy_string(name, strlen(name))));
+    instance_set_field(stats, AS_STRING(vm.stack_top[-1]),
+                       NUMBER_VAL((f64)value));
+    pop();
+}
+
+// The instance is left on the stack, where the collector sees it, until the
+// caller has filled it in.
+static struct obj_instance *push_stats(const char *class_name)
+{
+    push(OBJ_VAL(copy_string(class_name, strlen(class_name))));
+    struct obj_instance *stats =
+        alloc_instance(alloc_class(AS_STRING(vm.stack_top[-1])));
+    vm.stack_top[-1] = OBJ_VAL(stats);
+    return stats;
+}
+
+static value_ty gc_stats_native(i32 n_args, value_ty *args)
+{
+    (void)n_args;
+    (void)args;
+    struct obj_instance *stats = push_stats("GcStats");
+    set_stat(stats, "majorCollections", vm.gc_major_count);
+    set_stat(stats, "minorCollections", vm.gc_minor_count);
+    set_stat(stats, "compactions", vm.gc_compaction_count);
+    set_stat(stats, "bytesAllocated", vm.bytes_allocated);
+    set_stat(stats, "bytesFreed", vm.gc_bytes_freed);
+    set_stat(stats, "pauses", vm.gc_pause_count);
+    set_stat(stats, "pauseTotalNs", vm.gc_total_pause);
+    set_stat(stats, "pauseMaxNs", vm.gc_max_pause);
+
+    static const char *const buckets[GC_PAUSE_BUCKETS] = {
+        "pausesUnder10us", "pausesUnder100us", "pausesUnder1ms",
+        "pausesUnder10ms", "pausesUnder100ms", "pausesLonger",
+    };
+    for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        set_stat(stats, buckets[i], vm.gc_pause_histogram[i]);
+    }
+
+    size_t counts[OBJ_TYPE_COUNT];
+    heap_census(counts);
+    struct obj_instance *objects = push_stats("GcObjects");
+    for (size_t i = 0; i < OBJ_TYPE_COUNT; i++) {
+        set_stat(objects, object_type_name((enum obj_type)i), counts[i]);
+    }
+    push(OBJ_VAL(copy_string("objects", 7)));
+    instance_set_field(stats, AS_STRING(vm.stack_top[-1]), OBJ_VAL(objects));
+    vm.stack_top -= 3;
+    return OBJ_VAL(stats);
+}
+
+static value_ty gc_tune_native(i32 n_args, value_ty *args)
+{
+    static const char *const names[] = {
+        [GC_GROW_FACTOR] = "growFactor",
+        [GC_INITIAL_HEAP] = "initialHeap",
+        [GC_MAX_HEAP] = "maxHeap",
+        [GC_MIN_INTERVAL] = "minInterval",
+    };
+    if (n_args != 2 || !IS_STRING(args[0]) || !IS_NUMBER(args[1]))
+        return BOOL_VAL(false);
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(AS_CSTRING(args[0]), names[i]) == 0)
+            return BOOL_VAL(gc_tune((enum gc_setting)i, AS_NUMBER(args[1])));
+    }
+    return BOOL_VAL(false);
+}
+
 static void reset_stack(void)
 {
     vm.stack_top = vm.stack;
@@ -42,7 +117,8 @@ runtime_error(const char *format, ...)
         const struct call_frame *frame = &vm.frames[i];
         const struct obj_function *fn = frame->closure->fn;
         const size_t instruction = (size_t)(frame->ip - fn->chunk.code - 1);
-        fprintf(stderr, "[line %zu] in ", fn->chunk.lines[instruction].line);
+        fprintf(stderr, "[line %zu] in ",
+                chunk_getline(&fn->chunk, instruction));
 
         if (fn->name) {
             fprintf(stderr, "%s()\n", fn->name->chars);
@@ -57,11 +133,26 @@ runtime_error(const char *format, ...)
 void push(value_ty v);
 value_ty pop(void);
 
+size_t global_slot(struct obj_string *name)
+{
+    value_ty slot;
+    if (table_get(&vm.global_slots, name, &slot))
+        return (size_t)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    value_array_write(&vm.global_names, OBJ_VAL(name));
+    value_array_write(&vm.globals, UNDEFINED_VAL);
+    table_set(&vm.global_slots, name, NUMBER_VAL((f64)(vm.globals.count - 1)));
+    pop();
+    return vm.globals.count - 1;
+}
+
 static void define_native(const char *name, native_fn fn)
 {
     push(OBJ_VAL(copy_string(name, strlen(name))));
     push(OBJ_VAL(alloc_native(fn)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    const size_t slot = global_slot(AS_STRING(vm.stack[0]));
+    vm.globals.values[slot] = vm.stack[1];
     pop();
     pop();
 }
@@ -69,26 +160,62 @@ static void define_native(const char *name, native_fn fn)
 void vm_init(void)
 {
     reset_stack();
-    vm.objects = NULL;
+    slab_heap_init(&vm.slabs);
+    vm.sweep_class = SLAB_CLASS_COUNT;
+    vm.sweep_large = NULL;
+    nursery_init();
     vm.bytes_allocated = 0;
-    vm.next_gc = 1024 * 1024;
-    vm.gray_count = 0;
-    vm.gray_capacity = 0;
-    vm.gray_stack = NULL;
-    table_init(&vm.globals);
-    table_init(&vm.strings);
+    vm.gc_grow_factor = 2;
+    vm.gc_initial_heap = 1024 * 1024;
+    vm.gc_max_heap = 0;
+    vm.gc_min_interval = 0;
+    vm.next_gc = vm.gc_initial_heap;
+    vm.gc_pause_budget = 0;
+    vm.gc_concurrent = false;
+    vm.gc_pause_count = 0;
+    vm.gc_total_pause = 0;
+    vm.gc_max_pause = 0;
+    memset(vm.gc_pause_histogram, 0, sizeof(vm.gc_pause_histogram));
+    vm.gc_major_count = 0;
+    vm.gc_minor_count = 0;
+    vm.gc_compaction_count = 0;
+    vm.gc_bytes_freed = 0;
+    vm.gc_cpu_time = 0;
+    vm.gc_threads = 0;
+    vm.gc_compact_threshold = 0;
+    vm.compact_pending = false;
+    vm.compacting = false;
+    vm.gc_phase = GC_IDLE;
+    vm.remembered = (struct obj_stack){0};
+    vm.promoted = (struct obj_stack){0};
+    vm.gray_stack = (struct obj_stack){0};
+    vm.satb_log = (struct obj_stack){0};
+    vm.heap_lock_depth = 0;
+    vm.marker_paused = false;
+    vm.shapes = NULL;
+    vm.root_shape = shape_new_root();
+    table_init(&vm.global_slots);
+    value_array_init(&vm.global_names);
+    value_array_init(&vm.globals);
+    intern_set_init(&vm.strings);
 
     vm.init_string = NULL;
     vm.init_string = copy_string("init", 4);
 
     define_native("clock", clock_native);
+    define_native("gcStats", gc_stats_native);
+    define_native("gcTune", gc_tune_native);
 }
 
 void vm_free(void)
 {
     free_objects();
-    table_free(&vm.globals);
-    table_free(&vm.strings);
+    table_free(&vm.global_slots);
+    value_array_free(&vm.global_names);
+    value_array_free(&vm.globals);
+    intern_set_free(&vm.strings);
+    shapes_free();
+    vm.root_shape = NULL;
     vm.init_string = NULL;
 }
 
@@ -117,7 +244,9 @@ static bool call(struct obj_closure *closure, i32 n_args)
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX) {
+    if (vm.frame_count == FRAMES_MAX ||
+        vm.stack_top - n_args - 1 + closure->fn->max_locals >
+            vm.stack + STACK_MAX) {
         runtime_error("Stack overflow.");
         return false;
     }
@@ -168,19 +297,96 @@ static bool call_value(value_ty callee, i32 n_args)
     return false;
 }
 
-static bool invoke_from_class(const struct obj_class *klass,
-                              const struct obj_string *name, i32 n_args)
+static struct obj_closure *invoke_cache_lookup(const struct invoke_cache *cache,
+                                               const struct obj_class *klass,
+                                               const struct shape *shape)
 {
-    value_ty method;
-    if (!table_get(&klass->methods, name, &method)) {
-        runtime_error("Undefined property '%s'.", name->chars);
-        return false;
+    for (u8 i = 0; i < cache->count; i++) {
+        const struct invoke_cache_entry *entry = &cache->entries[i];
+        if (entry->klass == klass && entry->shape == shape &&
+            entry->version == klass->method_version) {
+            return entry->method;
+        }
+    }
+    return NULL;
+}
+
+static void update_invoke_cache(struct invoke_cache *cache,
+                                struct obj_class *klass, struct shape *shape,
+                                struct obj_closure *method)
+{
+    if (cache->megamorphic)
+        return;
+
+    // The cache belongs to the function being executed.
+    struct obj *owner = &vm.frames[vm.frame_count - 1].closure->fn->obj;
+    heap_lock();
+
+    // Reuse an entry that was invalidated by a change to the class.
+    for (u8 i = 0; i < cache->count; i++) {
+        struct invoke_cache_entry *entry = &cache->entries[i];
+        if (entry->klass == klass && entry->shape == shape) {
+            const value_ty old = OBJ_VAL(entry->method);
+            entry->version = klass->method_version;
+            entry->method = method;
+            write_barrier(owner, old, OBJ_VAL(method));
+            heap_unlock();
+            return;
+        }
+    }
+
+    if (cache->count == INVOKE_CACHE_SIZE) {
+        for (u8 i = 0; i < cache->count; i++) {
+            write_barrier(owner, OBJ_VAL(cache->entries[i].klass), NIL_VAL);
+            write_barrier(owner, OBJ_VAL(cache->entries[i].method), NIL_VAL);
+        }
+        cache->megamorphic = true;
+        cache->count = 0;
+        heap_unlock();
+        return;
+    }
+
+    cache->entries[cache->count++] = (struct invoke_cache_entry){
+        .klass = klass,
+        .shape = shape,
+        .version = klass->method_version,
+        .method = method,
+    };
+    write_barrier(owner, NIL_VAL, OBJ_VAL(klass));
+    write_barrier(owner, NIL_VAL, OBJ_VAL(method));
+    heap_unlock();
+}
+
+static bool invoke_from_class(struct obj_class *klass, struct shape *shape,
+                              const struct obj_string *name, i32 n_args,
+                              struct invoke_cache *cache)
+{
+    struct obj_closure *cached = invoke_cache_lookup(cache, klass, shape);
+    if (cached)
+        return call(cached, n_args);
+
+    // Receivers of classes down the hierarchy from the one the site last
+    // resolved the method in have it in the same slot.
+    const size_t slot = cache->slot;
+    struct obj_closure *method;
+    if (slot < klass->vtable_count && klass->vtable[slot].name == name) {
+        method = klass->vtable[slot].method;
+    } else {
+        const i64 found = class_method_slot(klass, name);
+        if (found < 0) {
+            runtime_error("Undefined property '%s'.", name->chars);
+            return false;
+        }
+        cache->slot = (u32)found;
+        method = klass->vtable[found].method;
     }
 
-    return call(AS_CLOSURE(method), n_args);
+    update_invoke_cache(cache, klass, shape, method);
+    return call(method, n_args);
 }
 
-static bool invoke(const struct obj_string *name, i32 n_args)
+static bool invoke(const struct obj_string *name, i32 n_args,
+                   struct invoke_cache *cache)
 {
     const value_ty receiver = peek(n_args);
     if (!IS_INSTANCE(receiver)) {
@@ -190,26 +396,34 @@ static bool invoke(const struct obj_string *name, i32 n_args)
 
     const struct obj_instance *instance = AS_INSTANCE(receiver);
 
+    // A cached entry for the receiver's shape means there is no field
+    // with this name, so the field lookup can be skipped too.
+    struct obj_closure *cached =
+        invoke_cache_lookup(cache, instance->klass, instance->shape);
+    if (cached)
+        return call(cached, n_args);
+
     value_ty value;
-    if (table_get(&instance->fields, name, &value)) {
+    if (instance_get_field(instance, name, &value)) {
         vm.stack_top[-n_args - 1] = value;
         return call_value(value, n_args);
     }
 
-    return invoke_from_class(instance->klass, name, n_args);
+    return invoke_from_class(instance->klass, instance->shape, name, n_args,
+                             cache);
 }
 
 static bool bind_method(const struct obj_class *klass,
                         const struct obj_string *name)
 {
-    value_ty method;
-    if (!table_get(&klass->methods, name, &method)) {
+    const i64 slot = class_method_slot(klass, name);
+    if (slot < 0) {
         runtime_error("Undefined property '%s'.", name->chars);
         return false;
     }
 
     struct obj_bound_method *bound =
-        alloc_bound_method(peek(0), AS_CLOSURE(method));
+        alloc_bound_method(peek(0), klass->vtable[slot].method);
     pop();
     push(OBJ_VAL(bound));
     return true;
@@ -245,7 +459,7 @@ static void close_upvalues(const value_ty *last)
 {
     while (vm.open_upvalues && vm.open_upvalues->location >= last) {
         struct obj_upvalue *upvalue = vm.open_upvalues;
-        upvalue->closed = *upvalue->location;
+        field_store(&upvalue->obj, &upvalue->closed, *upvalue->location);
         upvalue->location = &upvalue->closed;
         vm.open_upvalues = upvalue->next;
     }
@@ -255,8 +469,7 @@ static void define_method(struct obj_string *name)
 {
     const value_ty method = peek(0);
     struct obj_class *klass = AS_CLASS(peek(1));
-
-    table_set(&klass->methods, name, method);
+    class_set_method(klass, name, AS_CLOSURE(method));
 
     if (name == vm.init_string)
         klass->initializer = method;
@@ -264,28 +477,68 @@ static void define_method(struct obj_string *name)
     pop();
 }
 
+static void update_property_cache(struct property_cache *cache,
+                                  struct shape *shape,
+                                  struct shape *transition, size_t slot)
+{
+    if (cache->megamorphic)
+        return;
+
+    // A site that keeps missing sees too many shapes to be worth caching,
+    // so it goes back to looking fields up in the shape.
+    if (cache->shape && ++cache->misses > PROPERTY_CACHE_MAX_MISSES) {
+        cache->megamorphic = true;
+        cache->shape = NULL;
+        cache->transition = NULL;
+        return;
+    }
+
+    cache->shape = shape;
+    cache->transition = transition;
+    cache->slot = slot;
+}
+
 static bool is_falsey(value_ty v)
 {
     return IS_NIL(v) || (IS_BOOL(v) && (!AS_BOOL(v)));
 }
 
+// Ropes are only ever long, so short results are made of two strings.
 static void concatenate(void)
 {
-    const struct obj_string *b = AS_STRING(peek(0));
-    const struct obj_string *a = AS_STRING(peek(1));
-
-    const size_t length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    value_ty result;
+    if (text_length(peek(1)) + text_length(peek(0)) >= ROPE_MIN_LENGTH) {
+        result = OBJ_VAL(alloc_rope(peek(1), peek(0)));
+    } else {
+        const struct obj_string *b = AS_STRING(peek(0));
+        const struct obj_string *a = AS_STRING(peek(1));
 
-    const struct obj_string *result = take_string(chars, length);
+        struct obj_string *string = alloc_string(a->length + b->length);
+        memcpy(string->chars, a->chars, a->length);
+        memcpy(string->chars + a->length, b->chars, b->length);
+        result = OBJ_VAL(intern_string(string));
+    }
     pop();
     pop();
-    push(OBJ_VAL(result));
+    push(result);
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_instruction(const struct call_frame *frame)
+{
+    printf("          ");
+    for (const value_ty *slot = vm.stack; slot < vm.stack_top; slot++) {
+        printf("[ ");
+        value_print(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_instruction(
+        &frame->closure->fn->chunk,
+        (size_t)(frame->ip - frame->closure->fn->chunk.code));
+}
+#endif
+
 static enum interpret_result run(void)
 {
     struct call_frame *frame = &vm.frames[vm.frame_count - 1];
@@ -295,161 +548,372 @@ static enum interpret_result run(void)
     (frame->closure->fn->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT() \
     (frame->ip += 2, (u16)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op)                         \
+#define READ_LONG()                                                    \
+    (frame->ip += 3, (u32)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | \
+                           frame->ip[-1]))
+#define READ_CONSTANT_LONG() \
+    (frame->closure->fn->chunk.constants.values[READ_LONG()])
+#define READ_STRING() AS_STRING(READ_CONSTANT_LONG())
+// Step over a name operand, leaving it to be decoded with STRING_AT() only
+// if it is needed.
+#define SKIP_STRING() (frame->ip += 3, frame->ip - 3)
+#define STRING_AT(operand)                                            \
+    AS_STRING(frame->closure->fn->chunk.constants                     \
+                  .values[((operand)[0] << 16) | ((operand)[1] << 8) | \
+                          (operand)[2]])
+#define READ_PROPERTY_CACHE() \
+    (&frame->closure->fn->chunk.property_caches[READ_SHORT()])
+#define READ_INVOKE_CACHE() \
+    (&frame->closure->fn->chunk.invoke_caches[READ_SHORT()])
+// Rewrite the instruction being executed into a specialized form.
+#define QUICKEN(op) (frame->ip[-1] = (op))
+// Rewrite the instruction being executed back into its generic form and
+// execute that instead.
+#define DEQUICKEN(op)         \
+    do {                      \
+        frame->ip[-1] = (op); \
+        frame->ip--;          \
+        DISPATCH();           \
+    } while (false)
+// Minor collections move objects, so they only run at backward jumps and
+// calls, where no object pointers are held outside the VM's roots. Every
+// long-running program passes through one of them regularly.
+#define SAFEPOINT()            \
+    do {                       \
+        if (vm.nursery_full)   \
+            collect_nursery(); \
+    } while (false)
+#define BINARY_OP(value_type, op, quickened)              \
     do {                                                  \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
             runtime_error("Operands must be numbers.");   \
             return INTERPRET_RUNTIME_ERROR;               \
         }                                                 \
+        QUICKEN(quickened);                               \
+        f64 b = AS_NUMBER(pop());                         \
+        f64 a = AS_NUMBER(pop());                         \
+        push(value_type(a op b));                         \
+    } while (false)
+#define NUMBER_OP(value_type, op, generic)                \
+    do {                                                  \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+            DEQUICKEN(generic);                           \
+        }                                                 \
         f64 b = AS_NUMBER(pop());                         \
         f64 a = AS_NUMBER(pop());                         \
         push(value_type(a op b));                         \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (const value_ty *slot = vm.stack; slot < vm.stack_top; slot++) {
-            printf("[ ");
-            value_print(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(
-            &frame->closure->fn->chunk,
-            (size_t)(frame->ip - frame->closure->fn->chunk.code));
+#define TRACE_INSTRUCTION() trace_instruction(frame)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Each handler jumps straight to the next one through this table, so the
+    // branch predictor gets a separate indirect jump per opcode.
+    static void *const dispatch_table[] = {
+        [OP_CONSTANT] = &&do_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&do_OP_CONSTANT_LONG,
+        [OP_NIL] = &&do_OP_NIL,
+        [OP_TRUE] = &&do_OP_TRUE,
+        [OP_FALSE] = &&do_OP_FALSE,
+        [OP_POP] = &&do_OP_POP,
+        [OP_POPN] = &&do_OP_POPN,
+        [OP_GET_LOCAL] = &&do_OP_GET_LOCAL,
+        [OP_GET_LOCAL_WIDE] = &&do_OP_GET_LOCAL_WIDE,
+        [OP_SET_LOCAL] = &&do_OP_SET_LOCAL,
+        [OP_SET_LOCAL_WIDE] = &&do_OP_SET_LOCAL_WIDE,
+        [OP_GET_GLOBAL] = &&do_OP_GET_GLOBAL,
+        [OP_GET_GLOBAL_LONG] = &&do_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL] = &&do_OP_DEFINE_GLOBAL,
+        [OP_DEFINE_GLOBAL_LONG] = &&do_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_GLOBAL] = &&do_OP_SET_GLOBAL,
+        [OP_SET_GLOBAL_LONG] = &&do_OP_SET_GLOBAL_LONG,
+        [OP_GET_UPVALUE] = &&do_OP_GET_UPVALUE,
+        [OP_GET_UPVALUE_WIDE] = &&do_OP_GET_UPVALUE_WIDE,
+        [OP_SET_UPVALUE] = &&do_OP_SET_UPVALUE,
+        [OP_SET_UPVALUE_WIDE] = &&do_OP_SET_UPVALUE_WIDE,
+        [OP_GET_PROPERTY] = &&do_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&do_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&do_OP_GET_SUPER,
+        [OP_EQUAL] = &&do_OP_EQUAL,
+        [OP_GREATER] = &&do_OP_GREATER,
+        [OP_LESS] = &&do_OP_LESS,
+        [OP_ADD] = &&do_OP_ADD,
+        [OP_SUBTRACT] = &&do_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&do_OP_MULTIPLY,
+        [OP_DIVIDE] = &&do_OP_DIVIDE,
+        [OP_NOT] = &&do_OP_NOT,
+        [OP_NEGATE] = &&do_OP_NEGATE,
+        [OP_PRINT] = &&do_OP_PRINT,
+        [OP_JUMP] = &&do_OP_JUMP,
+        [OP_JUMP_LONG] = &&do_OP_JUMP_LONG,
+        [OP_JUMP_IF_FALSE] = &&do_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_FALSE_LONG] = &&do_OP_JUMP_IF_FALSE_LONG,
+        [OP_JUMP_IF_TRUE] = &&do_OP_JUMP_IF_TRUE,
+        [OP_JUMP_IF_TRUE_LONG] = &&do_OP_JUMP_IF_TRUE_LONG,
+        [OP_LOOP] = &&do_OP_LOOP,
+        [OP_LOOP_LONG] = &&do_OP_LOOP_LONG,
+        [OP_CALL] = &&do_OP_CALL,
+        [OP_INVOKE] = &&do_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&do_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&do_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&do_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&do_OP_RETURN,
+        [OP_CLASS] = &&do_OP_CLASS,
+        [OP_INHERIT] = &&do_OP_INHERIT,
+        [OP_METHOD] = &&do_OP_METHOD,
+        [OP_EQUAL_NUMBER] = &&do_OP_EQUAL_NUMBER,
+        [OP_GREATER_NUMBER] = &&do_OP_GREATER_NUMBER,
+        [OP_LESS_NUMBER] = &&do_OP_LESS_NUMBER,
+        [OP_ADD_NUMBER] = &&do_OP_ADD_NUMBER,
+        [OP_ADD_STRING] = &&do_OP_ADD_STRING,
+        [OP_SUBTRACT_NUMBER] = &&do_OP_SUBTRACT_NUMBER,
+        [OP_MULTIPLY_NUMBER] = &&do_OP_MULTIPLY_NUMBER,
+        [OP_DIVIDE_NUMBER] = &&do_OP_DIVIDE_NUMBER,
+    };
+
+#define CASE(op) do_##op
+#define DISPATCH()                         \
+    do {                                   \
+        TRACE_INSTRUCTION();               \
+        instruction = READ_BYTE();         \
+        goto *dispatch_table[instruction]; \
+    } while (false)
+#define INTERPRET_LOOP DISPATCH();
+#else
+#define CASE(op) case op
+#define DISPATCH() goto loop
+#define INTERPRET_LOOP         \
+    loop:                      \
+    TRACE_INSTRUCTION();       \
+    instruction = READ_BYTE(); \
+    switch (instruction)
 #endif
-        const u8 instruction = READ_BYTE();
-        switch (instruction) {
-        case OP_CONSTANT: {
+
+    u8 instruction;
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
             const value_ty constant = READ_CONSTANT();
             push(constant);
-            break;
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG): {
+            const value_ty constant = READ_CONSTANT_LONG();
+            push(constant);
+            DISPATCH();
         }
-        case OP_NIL: {
+        CASE(OP_NIL): {
             push(NIL_VAL);
-            break;
+            DISPATCH();
         }
-        case OP_TRUE: {
+        CASE(OP_TRUE): {
             push(BOOL_VAL(true));
-            break;
+            DISPATCH();
         }
-        case OP_FALSE: {
+        CASE(OP_FALSE): {
             push(BOOL_VAL(false));
-            break;
+            DISPATCH();
         }
-        case OP_POP: {
+        CASE(OP_POP): {
             pop();
-            break;
+            DISPATCH();
+        }
+        CASE(OP_POPN): {
+            vm.stack_top -= READ_BYTE();
+            DISPATCH();
         }
-        case OP_SET_LOCAL: {
+        CASE(OP_SET_LOCAL): {
             u8 slot = READ_BYTE();
             frame->slots[slot] = peek(0);
-            break;
+            DISPATCH();
         }
-        case OP_GET_LOCAL: {
+        CASE(OP_SET_LOCAL_WIDE): {
+            const u16 slot = READ_SHORT();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL): {
             u8 slot = READ_BYTE();
             push(frame->slots[slot]);
-            break;
+            DISPATCH();
         }
-        case OP_GET_GLOBAL: {
-            const struct obj_string *name = READ_STRING();
-            value_ty value;
-            if (!table_get(&vm.globals, name, &value)) {
-                runtime_error("Undefined variable '%s'.", name->chars);
+        CASE(OP_GET_LOCAL_WIDE): {
+            const u16 slot = READ_SHORT();
+            push(frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            const u16 slot = READ_SHORT();
+            const value_ty value = vm.globals.values[slot];
+            if (IS_UNDEFINED(value)) {
+                runtime_error("Undefined variable '%s'.",
+                              AS_CSTRING(vm.global_names.values[slot]));
                 return INTERPRET_RUNTIME_ERROR;
             }
             push(value);
-            break;
+            DISPATCH();
         }
-        case OP_DEFINE_GLOBAL: {
-            struct obj_string *name = READ_STRING();
-            table_set(&vm.globals, name, peek(0));
-            pop();
-            break;
+        CASE(OP_GET_GLOBAL_LONG): {
+            const u32 slot = READ_LONG();
+            const value_ty value = vm.globals.values[slot];
+            if (IS_UNDEFINED(value)) {
+                runtime_error("Undefined variable '%s'.",
+                              AS_CSTRING(vm.global_names.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            const u16 slot = READ_SHORT();
+            vm.globals.values[slot] = pop();
+            DISPATCH();
         }
-        case OP_SET_GLOBAL: {
-            struct obj_string *name = READ_STRING();
-            if (table_set(&vm.globals, name, peek(0))) {
-                table_delete(&vm.globals, name);
-                runtime_error("Undefined variable '%s'.", name->chars);
+        CASE(OP_DEFINE_GLOBAL_LONG): {
+            const u32 slot = READ_LONG();
+            vm.globals.values[slot] = pop();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            const u16 slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globals.values[slot])) {
+                runtime_error("Undefined variable '%s'.",
+                              AS_CSTRING(vm.global_names.values[slot]));
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            vm.globals.values[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_LONG): {
+            const u32 slot = READ_LONG();
+            if (IS_UNDEFINED(vm.globals.values[slot])) {
+                runtime_error("Undefined variable '%s'.",
+                              AS_CSTRING(vm.global_names.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.globals.values[slot] = peek(0);
+            DISPATCH();
         }
-        case OP_GET_UPVALUE: {
+        CASE(OP_GET_UPVALUE): {
             const u8 slot = READ_BYTE();
             push(*frame->closure->upvalues[slot]->location);
-            break;
+            DISPATCH();
         }
-        case OP_SET_UPVALUE: {
-            const u8 slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+        CASE(OP_GET_UPVALUE_WIDE): {
+            const u16 slot = READ_SHORT();
+            push(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            struct obj_upvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+            field_store(&upvalue->obj, upvalue->location, peek(0));
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE_WIDE): {
+            struct obj_upvalue *upvalue =
+                frame->closure->upvalues[READ_SHORT()];
+            field_store(&upvalue->obj, upvalue->location, peek(0));
+            DISPATCH();
         }
-        case OP_GET_PROPERTY: {
+        CASE(OP_GET_PROPERTY): {
             if (!IS_INSTANCE(peek(0))) {
                 runtime_error("Only instances have properties.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
             const struct obj_instance *instance = AS_INSTANCE(peek(0));
-            const struct obj_string *name = READ_STRING();
+            const u8 *name_operand = SKIP_STRING();
+            struct property_cache *cache = READ_PROPERTY_CACHE();
+
+            if (instance->shape == cache->shape) {
+                pop(); // Instance.
+                push(instance->fields[cache->slot]);
+                DISPATCH();
+            }
 
-            value_ty value;
-            if (table_get(&instance->fields, name, &value)) {
+            const struct obj_string *name = STRING_AT(name_operand);
+            const i64 slot = shape_lookup(instance->shape, name);
+            if (slot >= 0) {
+                update_property_cache(cache, instance->shape, NULL,
+                                      (size_t)slot);
                 pop(); // Instance.
-                push(value);
-                break;
+                push(instance->fields[slot]);
+                DISPATCH();
             }
 
             if (!bind_method(instance->klass, name)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            break;
+            DISPATCH();
         }
-        case OP_SET_PROPERTY: {
+        CASE(OP_SET_PROPERTY): {
             if (!IS_INSTANCE(peek(1))) {
                 runtime_error("Only instances have fields.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
             struct obj_instance *instance = AS_INSTANCE(peek(1));
-            table_set(&instance->fields, READ_STRING(), peek(0));
+            const u8 *name_operand = SKIP_STRING();
+            struct property_cache *cache = READ_PROPERTY_CACHE();
+
+            if (instance->shape != cache->shape) {
+                struct obj_string *name = STRING_AT(name_operand);
+                struct shape *shape = instance->shape;
+                const size_t slot = instance_set_field(instance, name, peek(0));
+                update_property_cache(
+                    cache, shape,
+                    instance->shape != shape ? instance->shape : NULL, slot);
+            } else if (cache->transition) {
+                instance_add_field(instance, cache->transition, peek(0));
+            } else {
+                field_store(&instance->obj, &instance->fields[cache->slot],
+                            peek(0));
+            }
+
             const value_ty value = pop();
             pop();
             push(value);
-            break;
+            DISPATCH();
         }
-        case OP_GET_SUPER: {
+        CASE(OP_GET_SUPER): {
             const struct obj_string *name = READ_STRING();
             const struct obj_class *superclass = AS_CLASS(pop());
 
             if (!bind_method(superclass, name)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            DISPATCH();
         }
-        case OP_EQUAL: {
-            const value_ty b = pop();
-            const value_ty a = pop();
-            push(BOOL_VAL(values_equal(a, b)));
-            break;
+        CASE(OP_EQUAL): {
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_EQUAL_NUMBER);
+            }
+            // Comparing ropes allocates, so the operands stay on the stack.
+            const bool equal = values_equal(peek(1), peek(0));
+            pop();
+            pop();
+            push(BOOL_VAL(equal));
+            DISPATCH();
         }
-        case OP_GREATER: {
-            BINARY_OP(BOOL_VAL, >);
-            break;
+        CASE(OP_GREATER): {
+            BINARY_OP(BOOL_VAL, >, OP_GREATER_NUMBER);
+            DISPATCH();
         }
-        case OP_LESS: {
-            BINARY_OP(BOOL_VAL, <);
-            break;
+        CASE(OP_LESS): {
+            BINARY_OP(BOOL_VAL, <, OP_LESS_NUMBER);
+            DISPATCH();
         }
-        case OP_ADD: {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        CASE(OP_ADD): {
+            if (is_text(peek(0)) && is_text(peek(1))) {
+                QUICKEN(OP_ADD_STRING);
                 concatenate();
             } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_ADD_NUMBER);
                 const f64 b = AS_NUMBER(pop());
                 const f64 a = AS_NUMBER(pop());
                 push(NUMBER_VAL(a + b));
@@ -457,103 +921,145 @@ static enum interpret_result run(void)
                 runtime_error("Operands must be two numbers or two strings.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            DISPATCH();
         }
-        case OP_SUBTRACT: {
-            BINARY_OP(NUMBER_VAL, -);
-            break;
+        CASE(OP_SUBTRACT): {
+            BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUMBER);
+            DISPATCH();
         }
-        case OP_MULTIPLY: {
-            BINARY_OP(NUMBER_VAL, *);
-            break;
+        CASE(OP_MULTIPLY): {
+            BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUMBER);
+            DISPATCH();
         }
-        case OP_DIVIDE: {
-            BINARY_OP(NUMBER_VAL, /);
-            break;
+        CASE(OP_DIVIDE): {
+            BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUMBER);
+            DISPATCH();
         }
-        case OP_NOT: {
+        CASE(OP_NOT): {
             push(BOOL_VAL(is_falsey(pop())));
-            break;
+            DISPATCH();
         }
-        case OP_NEGATE: {
+        CASE(OP_NEGATE): {
             if (!IS_NUMBER(peek(0))) {
                 runtime_error("Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
             push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
+            DISPATCH();
         }
-        case OP_PRINT: {
+        CASE(OP_PRINT): {
             value_print(pop());
             printf("\n");
-            break;
+            DISPATCH();
         }
-        case OP_JUMP: {
+        CASE(OP_JUMP): {
             const u16 offset = READ_SHORT();
             frame->ip += offset;
-            break;
+            DISPATCH();
         }
-        case OP_JUMP_IF_FALSE: {
+        CASE(OP_JUMP_LONG): {
+            const u32 offset = READ_LONG();
+            frame->ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
             const u16 offset = READ_SHORT();
             if (is_falsey(peek(0))) {
                 frame->ip += offset;
             }
-            break;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_LONG): {
+            const u32 offset = READ_LONG();
+            if (is_falsey(peek(0))) {
+                frame->ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_TRUE): {
+            const u16 offset = READ_SHORT();
+            if (!is_falsey(peek(0))) {
+                frame->ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_TRUE_LONG): {
+            const u32 offset = READ_LONG();
+            if (!is_falsey(peek(0))) {
+                frame->ip += offset;
+            }
+            DISPATCH();
         }
-        case OP_LOOP: {
+        CASE(OP_LOOP): {
             const u16 offset = READ_SHORT();
             frame->ip -= offset;
-            break;
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_LOOP_LONG): {
+            const u32 offset = READ_LONG();
+            frame->ip -= offset;
+            SAFEPOINT();
+            DISPATCH();
         }
-        case OP_CALL: {
+        CASE(OP_CALL): {
             const i32 n_args = READ_BYTE();
             if (!call_value(peek(n_args), n_args)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frame_count - 1];
-            break;
+            SAFEPOINT();
+            DISPATCH();
         }
-        case OP_INVOKE: {
+        CASE(OP_INVOKE): {
             const struct obj_string *method = READ_STRING();
             const u8 n_args = READ_BYTE();
-            if (!invoke(method, n_args)) {
+            struct invoke_cache *cache = READ_INVOKE_CACHE();
+            if (!invoke(method, n_args, cache)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frame_count - 1];
-            break;
+            SAFEPOINT();
+            DISPATCH();
         }
-        case OP_SUPER_INVOKE: {
+        CASE(OP_SUPER_INVOKE): {
             const struct obj_string *method = READ_STRING();
             const u8 n_args = READ_BYTE();
-            const struct obj_class *superclass = AS_CLASS(pop());
-            if (!invoke_from_class(superclass, method, n_args)) {
+            struct invoke_cache *cache = READ_INVOKE_CACHE();
+            struct obj_class *superclass = AS_CLASS(pop());
+            if (!invoke_from_class(superclass, NULL, method, n_args, cache)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frame_count - 1];
-            break;
+            SAFEPOINT();
+            DISPATCH();
         }
-        case OP_CLOSURE: {
-            struct obj_function *fn = AS_FUNCTION(READ_CONSTANT());
-            const struct obj_closure *closure = alloc_closure(fn);
+        CASE(OP_CLOSURE): {
+            struct obj_function *fn = AS_FUNCTION(READ_CONSTANT_LONG());
+            struct obj_closure *closure = alloc_closure(fn);
             push(OBJ_VAL(closure));
+            heap_lock();
             for (i32 i = 0; i < closure->upvalue_count; i++) {
                 const u8 is_local = READ_BYTE();
-                const u8 index = READ_BYTE();
+                const u16 index = READ_SHORT();
                 if (is_local) {
                     closure->upvalues[i] =
                         capture_upvalue(frame->slots + index);
                 } else {
                     closure->upvalues[i] = frame->closure->upvalues[index];
                 }
+                write_barrier(&closure->obj, NIL_VAL,
+                              OBJ_VAL(closure->upvalues[i]));
             }
-            break;
+            heap_unlock();
+            DISPATCH();
         }
-        case OP_CLOSE_UPVALUE: {
+        CASE(OP_CLOSE_UPVALUE): {
             close_upvalues(vm.stack_top - 1);
             pop();
-            break;
+            DISPATCH();
         }
-        case OP_RETURN: {
+        CASE(OP_RETURN): {
             const value_ty result = pop();
             close_upvalues(frame->slots);
             vm.frame_count--;
@@ -565,38 +1071,94 @@ static enum interpret_result run(void)
             vm.stack_top = frame->slots;
             push(result);
             frame = &vm.frames[vm.frame_count - 1];
-            break;
+            DISPATCH();
         }
-        case OP_CLASS: {
+        CASE(OP_CLASS): {
             push(OBJ_VAL(alloc_class(READ_STRING())));
-            break;
+            DISPATCH();
         }
-        case OP_INHERIT: {
+        CASE(OP_INHERIT): {
             const value_ty superclass = peek(1);
             if (!IS_CLASS(superclass)) {
                 runtime_error("Superclass must be a class.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            struct obj_class *subclass = AS_CLASS(peek(0));
-            table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+            class_inherit(AS_CLASS(peek(0)), AS_CLASS(superclass));
             pop(); // Subclass.
-            break;
+            DISPATCH();
         }
-        case OP_METHOD: {
+        CASE(OP_METHOD): {
             define_method(READ_STRING());
-            break;
+            DISPATCH();
         }
-        default:
-            runtime_error("Unknown opcode %d\n", instruction);
-            return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_EQUAL_NUMBER): {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                DEQUICKEN(OP_EQUAL);
+            }
+            const f64 b = AS_NUMBER(pop());
+            const f64 a = AS_NUMBER(pop());
+            push(BOOL_VAL(numbers_equal(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER_NUMBER): {
+            NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+            DISPATCH();
         }
+        CASE(OP_LESS_NUMBER): {
+            NUMBER_OP(BOOL_VAL, <, OP_LESS);
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUMBER): {
+            NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+            DISPATCH();
+        }
+        CASE(OP_ADD_STRING): {
+            if (!is_text(peek(0)) || !is_text(peek(1))) {
+                DEQUICKEN(OP_ADD);
+            }
+            concatenate();
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_NUMBER): {
+            NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+            DISPATCH();
+        }
+        CASE(OP_MULTIPLY_NUMBER): {
+            NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE_NUMBER): {
+            NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+            DISPATCH();
+        }
+#ifndef COMPUTED_GOTO
+        default:
+            break;
+#endif
     }
+
+    runtime_error("Unknown opcode %d\n", instruction);
+    return INTERPRET_RUNTIME_ERROR;
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
 #undef READ_STRING
+#undef SKIP_STRING
+#undef STRING_AT
+#undef READ_PROPERTY_CACHE
+#undef READ_INVOKE_CACHE
+#undef QUICKEN
+#undef DEQUICKEN
+#undef SAFEPOINT
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef TRACE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
+#undef INTERPRET_LOOP
 }
 
 enum interpret_result vm_interpret(const char *source)
@@ -2,12 +2,19 @@
 #define CLOX__VM_H_
 
 #include "common.h"
+#include "intern.h"
 #include "object.h"
+#include "slab.h"
 #include "table.h"
 #include "value.h"
 
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Room for FRAMES_MAX frames of up to 256 slots, and on top of those for one
+// frame with as many locals as the compiler allows.
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT + UINT16_COUNT)
+// Pauses are counted by length: under 10 us, 100 us, 1 ms, 10 ms, 100 ms,
+// and longer.
+#define GC_PAUSE_BUCKETS 6
 
 struct call_frame {
     struct obj_closure *closure;
@@ -15,24 +22,106 @@ struct call_frame {
     value_ty *slots;
 };
 
+// A growable stack of objects, used for the collector's worklists.
+struct obj_stack {
+    struct obj **objects;
+    size_t count;
+    size_t capacity;
+};
+
+enum gc_phase {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+};
+
 struct vm {
     struct call_frame frames[FRAMES_MAX];
     size_t frame_count;
 
     value_ty stack[STACK_MAX];
     value_ty *stack_top;
-    struct table globals;
-    struct table strings;
+    // Globals are addressed by slot. The compiler maps each name to a slot
+    // through global_slots, global_names maps slots back for error messages.
+    struct table global_slots;
+    struct value_array global_names;
+    struct value_array globals;
+    struct intern_set strings;
     const struct obj_string *init_string;
     struct obj_upvalue *open_upvalues;
+    struct shape *root_shape;
+    struct shape *shapes;
 
     size_t bytes_allocated;
+    // Heap size that starts the next major collection or, while one is in
+    // progress, that runs its next step.
     size_t next_gc;
+    // When major collections start, as set by gc_tune().
+    f64 gc_grow_factor;
+    size_t gc_initial_heap;
+    size_t gc_max_heap;
+    size_t gc_min_interval;
+    // Longest a step of a major collection may take, in nanoseconds. Zero
+    // runs each major collection in one go.
+    u64 gc_pause_budget;
+    // Mark the old generation on a background thread while the program
+    // runs.
+    bool gc_concurrent;
+    // Pauses of the program by any collection, in nanoseconds.
+    size_t gc_pause_count;
+    u64 gc_total_pause;
+    u64 gc_max_pause;
+    size_t gc_pause_histogram[GC_PAUSE_BUCKETS];
+    // Collections run so far, and the bytes of objects they freed.
+    size_t gc_major_count;
+    size_t gc_minor_count;
+    size_t gc_compaction_count;
+    size_t gc_bytes_freed;
+    // Time spent collecting on all threads, in nanoseconds.
+    u64 gc_cpu_time;
+    // Threads that mark the heap in a full collection, counting the one
+    // running the program. Zero uses one per CPU.
+    size_t gc_threads;
+    // Percentage of the old generation's pages that may be free before it is
+    // compacted. Zero never compacts.
+    u32 gc_compact_threshold;
+    // Set when a major collection left the old generation fragmented, which
+    // makes the next minor collection compact it.
+    bool compact_pending;
+    // Set while compaction points references at the objects it moved.
+    bool compacting;
+    enum gc_phase gc_phase;
 
-    struct obj *objects;
-    size_t gray_count;
-    size_t gray_capacity;
-    struct obj **gray_stack;
+    // The old generation. Its mark bits are kept in the slabs rather than
+    // in the objects.
+    struct slab_heap slabs;
+    // Sweeping is left to allocation, which sweeps the pages of the size
+    // classes it allocates from. The steps of a major collection sweep the
+    // rest, starting from this size class and large block.
+    size_t sweep_class;
+    struct slab_large *sweep_large;
+    // Young objects are bump-allocated here, and moved to the old generation
+    // by the first minor collection they survive.
+    u8 *nursery;
+    u8 *nursery_top;
+    u8 *nursery_end;
+    // One mark bit for each NURSERY_ALIGNMENT bytes of the nursery.
+    u64 *nursery_marks;
+    // Set when an allocation did not fit, which makes the VM run a minor
+    // collection at its next safepoint.
+    bool nursery_full;
+    // Old objects that may point into the nursery.
+    struct obj_stack remembered;
+    // Objects promoted by a minor collection whose fields are still to be
+    // updated.
+    struct obj_stack promoted;
+    struct obj_stack gray_stack;
+    // Objects whose references were overwritten during a concurrent
+    // marking, still to be handed to the marking thread.
+    struct obj_stack satb_log;
+    // Nesting of heap_lock(), and whether the marking thread is held off.
+    u32 heap_lock_depth;
+    bool marker_paused;
 };
 
 enum interpret_result {
@@ -49,4 +138,11 @@ void push(value_ty v);
 value_ty pop(void);
 enum interpret_result vm_interpret(const char *source);
 
+/**
+ * Resolve a global variable name to its slot, adding an undefined slot for
+ * names seen for the first time.
+ * @return The index of the slot in vm.globals.
+ */
+size_t global_slot(struct obj_string *name);
+
 #endif // CLOX__VM_H_